@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+namespace knn {
+
+// a contiguous array either owning its elements or viewing memory owned
+// elsewhere (a mapped model file); a view is copied into owned storage
+// the first time it is modified
+template<class T>
+struct Array
+{
+  std::vector<T> storage;
+  const T* mapped;
+  size_t mapped_size;
+
+  Array() : storage(), mapped(NULL), mapped_size(0) {};
+
+  size_t size() const { return mapped ? mapped_size : storage.size(); }
+  bool empty() const { return size() == 0; }
+
+  const T* data() const { return mapped ? mapped : storage.data(); }
+  const T* begin() const { return data(); }
+  const T* end() const { return data() + size(); }
+
+  inline const T& operator[](size_t i) const { return data()[i]; }
+  const T& back() const { return data()[size() - 1]; }
+
+  void view(const T* p, size_t n)
+  {
+    std::vector<T>().swap(storage);
+    mapped = p;
+    mapped_size = n;
+  }
+
+  void detach()
+  {
+    if(mapped)
+    {
+      storage.assign(mapped, mapped + mapped_size);
+      mapped = NULL;
+      mapped_size = 0;
+    }
+  }
+
+  T* mutable_data() { detach(); return storage.data(); }
+
+  void push_back(const T& t) { detach(); storage.push_back(t); }
+  void append(const T* p, size_t n) { detach(); storage.insert(storage.end(), p, p + n); }
+  void reserve(size_t n) { detach(); storage.reserve(n); }
+  void resize(size_t n) { detach(); storage.resize(n); }
+  void assign(size_t n, const T& t) { detach(); storage.assign(n, t); }
+  void clear() { mapped = NULL; mapped_size = 0; storage.clear(); }
+};
+
+// strings stored back to back, each followed by a '\0'
+struct StringTable
+{
+  Array<size_t> offsets;
+  Array<char> chars;
+
+  StringTable() : offsets(), chars() { offsets.push_back(0); };
+
+  size_t size() const { return offsets.size() - 1; }
+
+  inline const char* operator[](size_t i) const { return chars.data() + offsets[i]; }
+
+  void reserve(size_t n) { offsets.reserve(n + 1); }
+
+  void push_back(const std::string& s)
+  {
+    for(const auto& c : s)
+      chars.push_back(c);
+    chars.push_back('\0');
+    offsets.push_back(chars.size());
+  }
+
+  void append(const StringTable& t)
+  {
+    size_t shift = chars.size();
+    chars.append(t.chars.data(), t.chars.size());
+    for(size_t i = 1; i < t.offsets.size(); ++i)
+      offsets.push_back(t.offsets[i] + shift);
+  }
+};
+
+}
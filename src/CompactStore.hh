@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Example.hh"
+#include "TrainingSet.hh"
+
+namespace knn {
+
+enum precision_type {FLOAT64, FLOAT32, INT8};
+
+// a copy of the training values in reduced precision, read by the scan
+// instead of the doubles: float32 halves the bytes per value, int8
+// divides them by eight
+// an int8 value q of feature f stands for q * scales[f], scales[f] being
+// the largest magnitude of f in the normalised training set over 127;
+// the scales are folded into the query (see prepare) so that the kernels
+// only widen the stored values
+// feature ids are shared with the training set
+struct CompactStore
+{
+  precision_type precision;
+  const TrainingSet* training;
+  std::vector<float> values32;
+  std::vector<int8_t> values8;
+  std::vector<double> scales;
+  std::vector<double> squared_norms;
+
+  CompactStore() : precision(FLOAT64), training(NULL), values32(), values8(), scales(), squared_norms() {};
+
+  void build(const TrainingSet& t, precision_type p)
+  {
+    precision = p;
+    training = &t;
+    if(precision == FLOAT64)
+      return;
+
+    size_t n = t.values.size();
+    squared_norms.assign(t.size(), 0);
+    scales.clear();
+
+    if(precision == FLOAT32)
+    {
+      values32.resize(n);
+      for(size_t i = 0; i < n; ++i)
+        values32[i] = t.values[i];
+    }
+    else
+    {
+      for(size_t i = 0; i < n; ++i)
+      {
+        unsigned id = t.feature_ids[i];
+        if(scales.size() <= id)
+          scales.resize(id + 1, 0);
+        scales[id] = std::max(scales[id], std::fabs(t.values[i]));
+      }
+      for(auto& s : scales)
+        s = s > 0 ? s / 127 : 1;
+
+      values8.resize(n);
+      for(size_t i = 0; i < n; ++i)
+        values8[i] = quantise(i);
+    }
+
+    for(size_t r = 0; r < t.size(); ++r)
+      for(size_t j = t.row_begin(r); j < t.row_end(r); ++j)
+      {
+        double v = value(j);
+        squared_norms[r] += v * v;
+      }
+
+    fprintf(stderr, "training values stored on %lu bytes each\n",
+            precision == FLOAT32 ? sizeof(float) : sizeof(int8_t));
+  }
+
+  int8_t quantise(size_t j) const
+  {
+    double q = std::round(training->values[j] / scales[training->feature_ids[j]]);
+    return int8_t(std::max(-127.0, std::min(127.0, q)));
+  }
+
+  // store row r of the training set, appended after the build: a feature
+  // new to int8 gets its scale from that row, a value beyond the scale of
+  // its feature is clamped
+  void add(size_t r)
+  {
+    if(precision == FLOAT64)
+      return;
+
+    const TrainingSet& t = *training;
+    double squared_norm = 0;
+    for(size_t j = t.row_begin(r); j < t.row_end(r); ++j)
+    {
+      if(precision == FLOAT32)
+        values32.push_back(t.values[j]);
+      else
+      {
+        unsigned id = t.feature_ids[j];
+        if(scales.size() <= id)
+          scales.resize(id + 1, 0);
+        if(scales[id] == 0)
+          scales[id] = t.values[j] != 0 ? std::fabs(t.values[j]) / 127 : 1;
+        values8.push_back(quantise(j));
+      }
+      squared_norm += value(j) * value(j);
+    }
+    squared_norms.push_back(squared_norm);
+  }
+
+  // the value stored at position j, as a double
+  double value(size_t j) const
+  {
+    return precision == FLOAT32 ? values32[j] :
+        precision == INT8 ? values8[j] * scales[training->feature_ids[j]] :
+        training->values[j];
+  }
+
+  template<class T>
+  CompactRow<T> row(size_t i, const std::vector<T>& values) const
+  {
+    size_t b = training->row_begin(i);
+    CompactRow<T> r = { training->feature_ids.data() + b, values.data() + b, training->row_end(i) - b,
+                        squared_norms[i] };
+    return r;
+  }
+
+  // the query to compare with the stored rows: for int8 its values are
+  // multiplied by the scales of their features, its norm is unchanged
+  Query prepare(const Query& query) const
+  {
+    Query res(query);
+    if(precision == INT8)
+      for(size_t i = 0; i < res.ids.size(); ++i)
+        res.values[i] *= res.ids[i] < scales.size() ? scales[res.ids[i]] : 0;
+    return res;
+  }
+};
+
+}
@@ -6,15 +6,13 @@
 #include <vector>
 #include <string>
 #include <cassert>
+#include <cmath>
+#include <algorithm>
 #include <unordered_map>
 
-#ifdef USE_BOOST_THREAD
-#include <boost/thread.hpp>
-namespace threadns = boost;
-#else
-#include <thread>
-namespace threadns = std;
-#endif
+#include "Threads.hh"
+#include "Kernels.hh"
+#include "Stats.hh"
 
 int counter = 0;
 std::unordered_map<std::string,int> string_map;
@@ -23,10 +21,57 @@ int count_map_counter;
 
 threadns::mutex mutex_string_map;
 
-typedef threadns::unique_lock<threadns::mutex> lock_type;
-
 namespace knn {
 
+// whether a feature is too rare in the training data to be kept
+inline bool is_noise(unsigned id, double threshold)
+{
+  auto c = count_map.find(id);
+  return (c == count_map.end() ? 0.0 : c->second) / count_map_counter < threshold;
+}
+
+// feature names and counts private to one parsing thread, merged into
+// the global dictionary once parsing is over so that parsers share no lock
+struct LocalDictionary
+{
+  std::unordered_map<std::string,unsigned> ids;
+  std::vector<const std::string*> names;  // by local id, in order of first appearance
+  std::vector<double> counts;
+  int total;
+
+  LocalDictionary() : ids(), names(), counts(), total(0) {};
+
+  unsigned insert(const std::string& name, int count)
+  {
+    auto res = ids.insert(std::make_pair(name, (unsigned) names.size()));
+    if(res.second)
+    {
+      names.push_back(&res.first->first);
+      counts.push_back(0);
+    }
+    counts[res.first->second] += count;
+    total += count;
+    return res.first->second;
+  }
+
+  // add the features to the global dictionary, new ones numbered in order
+  // of first appearance; returns the global id of each local one
+  std::vector<unsigned> merge() const
+  {
+    std::vector<unsigned> res(names.size());
+    for(size_t i = 0; i < names.size(); ++i)
+    {
+      auto resf = string_map.insert(std::make_pair(*names[i], counter));
+      if(resf.second)
+        ++counter;
+      res[i] = resf.first->second;
+      count_map[res[i]] += counts[i];
+    }
+    count_map_counter += total;
+    return res;
+  }
+};
+
 struct Feature {
 
   unsigned id;
@@ -43,62 +88,91 @@ struct Example {
   std::string id;
   std::string category;
   std::vector<Feature> features;
-  double distance;
 
-  Example() : id(), category(), features(), distance(0.0) {
+  Example() : id(), category(), features() {
   }
 
 
   Example(char* input, bool normalise, bool add_features)
-      : id(), category(), features(), distance(0.0) {
+      : id(), category(), features() {
     load(input, normalise, add_features);
   }
 
   // load an example from a line 'category feature_id:value .... feature_id:value' # comment
   // no error checking
   void load(char* line, bool normalise, bool add_features) {
-    char * input = line;
-    char *token = NULL;
-
-    double norm = 0;
-
-
-    //    fprintf(stderr, "%s", line);
-
-    //TODO: uncomment this
-    // char *comment = strchr(input, '#');
-    // if(comment != NULL) *comment = '\0'; // skip comments
-
-    token =  strsep(&input, " \t"); // read id
-
-    id = token;
-
-    token = strsep(&input, " \t"); // read category
-
-    category = token;
+    load(line, line + strlen(line), normalise, add_features);
+  }
 
-    //    fprintf(stderr, "loss: %g\n", loss);
-    for(;(token = strsep(&input, " \t\n")) && *token != '\0' ;) {
-      //      fprintf(stderr, "token: %s\n", token);
-      char* value = strrchr(token, ':');
+  // same from the characters [begin, end), which are left untouched so that
+  // lines can be parsed in place from a read-only mapping:
+  // tokens are separated by a space, a tab or a newline and the first empty
+  // token ends the line; feature names shorter than 5 characters are
+  // skipped, longer ones truncated to 5
+  // if a local dictionary is given, new features are added to it rather
+  // than to the global one and get its local ids
+  void load(const char* begin, const char* end, bool normalise, bool add_features,
+            LocalDictionary* dictionary = NULL) {
+    const char* input = begin;
+    const char* token = NULL;
 
-      *value = '\0';
+    double norm = 0;
 
-      if(strlen(token) < 5)
+    features.clear();
+
+    token = input;
+    input = next_separator(input, end); // read id
+    id.assign(token, input);
+    if(input < end) ++input;
+
+    token = input;
+    input = next_separator(input, end); // read category
+    category.assign(token, input);
+    if(input < end) ++input;
+
+    while(input < end) {
+      token = input;
+      input = next_separator(input, end);
+      if(input == token)
+        break;
+      const char* token_end = input;
+      if(input < end) ++input;
+
+      const char* value = token_end;
+      while(value > token && value[-1] != ':')
+        --value;
+      if(value == token || value - 1 - token < 5)
         continue;
-      token[5] = '\0';
 
-      double value_as_double = strtod(value + 1, NULL);
+      // strtod needs a terminated copy, the token may end the mapping
+      char buffer[64];
+      size_t length = std::min<size_t>(token_end - value, sizeof(buffer) - 1);
+      memcpy(buffer, value, length);
+      buffer[length] = '\0';
+      double value_as_double = strtod(buffer, NULL);
 
       if(normalise)
         norm += value_as_double * value_as_double;
 
       int feature_id = -1;
+      std::string name(token, 5);
+
+      if(add_features && dictionary)
+      {
+        features.emplace_back(dictionary->insert(name, int(value_as_double)), value_as_double);
+        continue;
+      }
 
-      lock_type lock2(mutex_string_map);
-      if (add_features || string_map.count(token))
+      // the wait is only timed when another thread holds the lock
+      lock_type lock2(mutex_string_map, threadns::defer_lock);
+      if(!lock2.try_lock())
+      {
+        stats::Timer timer(stats::DICTIONARY_WAIT);
+        lock2.lock();
+      }
+      if (add_features || string_map.count(name))
       {
-        auto resf = string_map.insert(std::make_pair(token, counter));
+        auto resf = string_map.insert(std::make_pair(name, counter));
         if(resf.second)
           ++counter;
 
@@ -116,8 +190,6 @@ struct Example {
         features.emplace_back(feature_id, value_as_double);
     }
 
-    //    fprintf(stderr, "line loaded\n");
-
     if(normalise)
     {
       norm = std::sqrt(norm);
@@ -129,12 +201,14 @@ struct Example {
     }
 
     std::sort(features.begin(), features.end());
-
-    //    fprintf(stderr, "size: %d\n", features.size());
-
-
   }
 
+  static const char* next_separator(const char* p, const char* end)
+  {
+    while(p < end && *p != ' ' && *p != '\t' && *p != '\n')
+      ++p;
+    return p;
+  }
 
   void remove_noise(double threshold)
   {
@@ -142,108 +216,38 @@ struct Example {
         (std::remove_if(features.begin(), features.end(),
                         [&](Feature& f)
                         {
-                          return double(count_map[f.id]) / count_map_counter < threshold;
+                          return is_noise(f.id, threshold);
                         }
                         ),
          features.end());
   }
+};
 
+// the features of an example split into id and value arrays,
+// as the distance kernels expect them
+struct Query
+{
+  std::vector<unsigned> ids;
+  std::vector<double> values;
+  double squared_norm;
 
-  void compute_distance( Example& other) {
-    other.distance = 0;
-
-    //    fprintf(stderr, "DISTANCE\n");
-
-    auto i = this->features.begin(), j = other.features.begin();
-
-    while(i != this->features.end() && j != other.features.end()) {
-
-      //      fprintf(stderr,"%d:%f\t%d:%f\n", i->id, i->value, j->id, j->value);
-
-      if(i->id < j->id)
-      {
-        other.distance += i->value * i->value;
-        ++i;
-      }
-      else if (j->id < i->id)
-      {
-        other.distance += j->value * j->value;
-        ++j;
-      }
-      else // equal
-      {
-        other.distance += (i->value - j->value) * (i->value - j->value);
-        ++i; ++j;
-      }
-    }
-
-    while(i != this->features.end()) { other.distance += i->value * i->value; ++i; }
-    while(j != other.features.end()) { other.distance += j->value * j->value; ++j; }
-  }
-
-  void compute_distances(std::vector<Example*>& example, int begin, int end)
-  {
-    for (int i = begin; i < end; ++i)
-    {
-      compute_distance(*example[i]);
-    }
-  }
-
-  void compute_similarity( Example& other) {
-    other.distance = 0;
-
-    //    fprintf(stderr, "DISTANCE\n");
-
-    double magthis = 0 ;
-    double magother = 0;
-
-
-    auto i = this->features.begin(), j = other.features.begin();
-
-    while(i != this->features.end() && j != other.features.end()) {
-
-      //      fprintf(stderr,"%d:%f\t%d:%f\n", i->id, i->value, j->id, j->value);
-
-      if(i->id < j->id)
-      {
-        magthis += i->value * i->value;
-        ++i;
-      }
-      else if (j->id < i->id)
-      {
-        magother += j->value * j->value;
-        ++j;
-      }
-      else // equal
-      {
-        other.distance += i->value * j->value;
-        magthis += i->value * i->value;
-        magother += j->value * j->value;
-        ++i; ++j;
-      }
-    }
-
-    while(i != this->features.end()) { magthis  += i->value * i->value; ++i; }
-    while(j != other.features.end()) { magother += j->value * j->value; ++j; }
-
-    other.distance /= std::sqrt(magthis) * std::sqrt(magother);
-    other.distance = 1 - other.distance;
-  }
-
-  void compute_similarities(std::vector<Example*>& example, int begin, int end)
+  Query(const Example& e) : ids(), values(), squared_norm(0)
   {
-    for (int i = begin; i < end; ++i)
+    ids.reserve(e.features.size());
+    values.reserve(e.features.size());
+    for(const auto& f : e.features)
     {
-      compute_similarity(*example[i]);
+      ids.push_back(f.id);
+      values.push_back(f.value);
     }
+    squared_norm = kernels::squared_norm(values.data(), values.size());
   }
 
-
-  inline bool operator<(const Example& o) const
+  SparseRow row() const
   {
-    return distance < o.distance;
+    SparseRow r = { ids.data(), values.data(), ids.size(), squared_norm };
+    return r;
   }
-
 };
 
 }
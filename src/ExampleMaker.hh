@@ -1,84 +1,68 @@
 #ifndef _EXAMPLEMAKER_HH_
 #define _EXAMPLEMAKER_HH_
 
+#include <string.h>
 #include <vector>
-#include <unordered_map>
+#include <algorithm>
 
 #include "Example.hh"
+#include "TrainingSet.hh"
 
 namespace knn {
 
+  // parses the lines [begin, end) of a mapped training file in place into
+  // its own training set, with feature ids from its own dictionary;
+  // the chunks are renumbered and concatenated in file order
   struct ExampleMaker
   {
+    const char* begin;
+    const char* end;
+    TrainingSet examples;
+    LocalDictionary dictionary;
 
-    threadns::thread my_thread;
+    ExampleMaker(const char* b, const char* e)
+      : begin(b), end(e), examples(), dictionary() {};
 
-    std::vector<char*>& lines;
-    std::vector<Example*>& examples;
-
-    ExampleMaker(std::vector<char*> &l, std::vector<Example*>& e)
-      : my_thread(), lines(l), examples(e) {};
-
-    ~ExampleMaker() {}
-
-    void join() {
-      my_thread.join();
-    }
-
-    void create_examples(threadns::mutex* mlines, int* processed_lines, int* finished, threadns::condition_variable* cond_process, threadns::mutex* mutex_examples)
+    void create_examples()
     {
-      while(1) {
-	int index;
-	char * string;
-
-        lock_type lock(*mlines);
-
-        while(((unsigned) *processed_lines == lines.size()) && !*finished) {
-#ifdef USE_BOOST_THREAD
-	  //cond_process->wait(lock); // no deadlock with boost implementation  ?
-          cond_process->timed_wait(lock, boost::posix_time::milliseconds(10));
-#else
-	  // prevent deadlock with posix implementation
-	 cond_process->wait_for(lock, std::chrono::duration<int,std::milli>(10));
-#endif
-        }
-
-	if(*finished && ((unsigned) *processed_lines == lines.size())) { lock.unlock(); break;}
-
-	index = (*processed_lines)++;
-	string = lines[index];
-
-        lock.unlock();
+      Example e;  // reused so that lines are parsed without allocating
 
-        Example * e = new Example(string, true, true);
-        //	Example * e = new Example(string, false, true);
-
-        lock_type lock2(*mutex_examples);
-        if (examples.size() < lines.size())
-          examples.resize(lines.size(),NULL);
-	examples[index] = e;
-        if(index % 1000 == 0)
-        fprintf(stderr, "%d examples read\r", index);
-        lock2.unlock();
-
-        delete lines[index];
-
-
-        //        fprintf(stderr, "after resize\n");
+      for(const char* line = begin; line < end;)
+      {
+        const char* eol = (const char*) memchr(line, '\n', end - line);
+        const char* next = eol ? eol + 1 : end;
 
+        e.load(line, next, true, true, &dictionary);
+        examples.add(e);
 
+        line = next;
       }
     }
+  };
 
-    void start(threadns::mutex* mlines, int* processed_lines, int* finished, threadns::condition_variable* cond_process, threadns::mutex* mutex_examples)
+  // the end of the examples in a training file: its first empty line
+  inline const char* examples_end(const char* begin, const char* end)
+  {
+    if(begin < end && *begin == '\n')
+      return begin;
+    const char* p = (const char*) memmem(begin, end - begin, "\n\n", 2);
+    return p ? p + 1 : end;
+  }
+
+  // n + 1 bounds splitting [begin, end) in n chunks of about the same
+  // size, each ending after a newline
+  inline std::vector<const char*> split_lines(const char* begin, const char* end, int n)
+  {
+    std::vector<const char*> res(1, begin);
+    for(int i = 1; i < n; ++i)
     {
-      my_thread = threadns::thread(&ExampleMaker::create_examples, this,
-				   mlines, processed_lines, finished, cond_process,
-                                   mutex_examples);
+      const char* p = std::max(begin + (end - begin) * i / n, res.back());
+      const char* eol = (const char*) memchr(p, '\n', end - p);
+      res.push_back(eol ? eol + 1 : end);
     }
-
-
-  };
+    res.push_back(end);
+    return res;
+  }
 }
 
 
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <algorithm>
+#include <functional>
+
+#include "Example.hh"
+#include "TrainingSet.hh"
+#include "ThreadPool.hh"
+#include "TopK.hh"
+#include "Random.hh"
+
+namespace knn {
+
+// hierarchical navigable small world graph (Malkov & Yashunin): every row
+// is a node of layer 0 and, with a probability decreasing geometrically,
+// of the layers above; a search descends greedily from the entry point on
+// the sparse upper layers, then explores layer 0 keeping the ef nearest
+// nodes found
+// the links of a node at layer 0 are links0[node * (m0+1) ..], the first
+// entry being their number; those at layer l > 0 are likewise found in
+// upper[node][(l-1) * (m+1) ..]
+struct HnswIndex
+{
+  typedef kernels::distance_function distance_function;
+  typedef std::pair<double, unsigned> Candidate;
+
+  unsigned m;
+  unsigned m0;
+  unsigned ef_construction;
+  unsigned ef_search;
+  const TrainingSet* training;
+  distance_function distance;
+
+  std::vector<int> levels;
+  std::vector<unsigned> links0;
+  std::vector<std::vector<unsigned> > upper;
+  unsigned entry;
+  int max_level;
+
+  // per-node locks, only taken while the graph is being built
+  // (a deque grows without moving them)
+  mutable std::deque<threadns::mutex> locks;
+  threadns::mutex entry_mutex;
+
+  // per-thread marks of the nodes met by a search, a mark is valid
+  // if it equals the tag of the current search
+  struct Visited
+  {
+    std::vector<unsigned> marks;
+    unsigned tag;
+
+    Visited() : marks(), tag(0) {};
+  };
+
+  HnswIndex() : m(0), m0(0), ef_construction(0), ef_search(0), training(NULL), distance(NULL),
+                levels(), links0(), upper(), entry(0), max_level(-1), locks(), entry_mutex() {};
+
+  const unsigned* links(unsigned node, int level) const
+  {
+    return level == 0 ? &links0[node * (m0 + 1)] : &upper[node][(level - 1) * (m + 1)];
+  }
+
+  unsigned* links(unsigned node, int level)
+  {
+    return level == 0 ? &links0[node * (m0 + 1)] : &upper[node][(level - 1) * (m + 1)];
+  }
+
+  void build(const TrainingSet& t, distance_function d, unsigned M, unsigned efc, unsigned efs,
+             ThreadPool* pool, int num_threads)
+  {
+    training = &t;
+    distance = d;
+    m = M;
+    m0 = 2 * M;
+    ef_construction = efc;
+    ef_search = efs;
+
+    size_t n = t.size();
+
+    levels.resize(n);
+    upper.resize(n);
+    links0.assign(n * (m0 + 1), 0);
+    std::deque<threadns::mutex>(n).swap(locks);
+
+    for(size_t i = 0; i < n; ++i)
+    {
+      levels[i] = draw_level(i);
+      upper[i].assign(levels[i] * (m + 1), 0);
+    }
+
+    max_level = -1;
+    if(n == 0)
+      return;
+
+    entry = 0;
+    max_level = levels[0];
+
+    pool->parallel_for(num_threads,
+                       [&](int i)
+                       {
+                         for(size_t node = i + 1; node < n; node += num_threads)
+                           insert(node);
+                       }
+                       );
+
+    fprintf(stderr, "hnsw index built: %lu nodes, %d levels\n", n, max_level + 1);
+  }
+
+  // the highest layer of a node, drawn by hashing it
+  int draw_level(size_t node) const
+  {
+    return int(-std::log(uniform(mix64(node))) * (1 / std::log(double(std::max(m, 2u)))));
+  }
+
+  // link row node of the training set, appended after the build
+  void add(unsigned node)
+  {
+    levels.push_back(draw_level(node));
+    upper.push_back(std::vector<unsigned>(levels[node] * (m + 1), 0));
+    links0.resize(levels.size() * (m0 + 1), 0);
+    locks.emplace_back();
+
+    if(max_level < 0)
+    {
+      entry = node;
+      max_level = levels[node];
+    }
+    else
+      insert(node);
+  }
+
+  // the ef nearest nodes to q found at level from the entry points, unordered
+  std::vector<Candidate> search_layer(const SparseRow& q, const std::vector<Candidate>& entries,
+                                      unsigned ef, int level, bool locking) const
+  {
+    static thread_local Visited visited;
+    if(visited.marks.size() < levels.size())
+      visited.marks.resize(levels.size(), 0);
+    if(++visited.tag == 0)
+    {
+      std::fill(visited.marks.begin(), visited.marks.end(), 0);
+      visited.tag = 1;
+    }
+    std::vector<unsigned>& marks = visited.marks;
+    unsigned tag = visited.tag;
+
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > candidates;
+    std::priority_queue<Candidate> results;
+
+    for(const auto& e : entries)
+    {
+      marks[e.second] = tag;
+      candidates.push(e);
+      results.push(e);
+    }
+
+    std::vector<unsigned> neighbours;
+    size_t scanned = 0;
+
+    while(!candidates.empty())
+    {
+      Candidate c = candidates.top();
+      if(results.size() >= ef && c.first > results.top().first)
+        break;
+      candidates.pop();
+
+      if(locking)
+        locks[c.second].lock();
+      const unsigned* l = links(c.second, level);
+      neighbours.assign(l + 1, l + 1 + l[0]);
+      if(locking)
+        locks[c.second].unlock();
+
+      for(const auto& n : neighbours)
+      {
+        if(marks[n] == tag)
+          continue;
+        marks[n] = tag;
+
+        double d = distance(q, training->row(n));
+        ++scanned;
+        if(results.size() < ef || d < results.top().first)
+        {
+          candidates.push(Candidate(d, n));
+          results.push(Candidate(d, n));
+          if(results.size() > ef)
+            results.pop();
+        }
+      }
+    }
+
+    // the searches of the build are not queries
+    if(!locking)
+      stats::count(stats::EXAMPLES_SCANNED, scanned);
+
+    std::vector<Candidate> res;
+    res.reserve(results.size());
+    for(; !results.empty(); results.pop())
+      res.push_back(results.top());
+    return res;
+  }
+
+  // at most max candidates, nearest first, skipping those closer to an
+  // already selected one than to the node being linked (the heuristic
+  // keeps links spread in all directions)
+  std::vector<Candidate> select(std::vector<Candidate> candidates, unsigned max) const
+  {
+    std::sort(candidates.begin(), candidates.end());
+
+    std::vector<Candidate> res;
+    for(const auto& c : candidates)
+    {
+      if(res.size() >= max)
+        break;
+
+      bool keep = true;
+      for(const auto& r : res)
+        if(distance(training->row(c.second), training->row(r.second)) < c.first)
+        {
+          keep = false;
+          break;
+        }
+      if(keep)
+        res.push_back(c);
+    }
+    return res;
+  }
+
+  void connect(unsigned node, int level, const std::vector<Candidate>& selected)
+  {
+    unsigned max = level == 0 ? m0 : m;
+
+    locks[node].lock();
+    unsigned* l = links(node, level);
+    l[0] = 0;
+    for(const auto& s : selected)
+      l[++l[0]] = s.second;
+    locks[node].unlock();
+
+    for(const auto& s : selected)
+    {
+      lock_type lock(locks[s.second]);
+      unsigned* sl = links(s.second, level);
+
+      if(sl[0] < max)
+      {
+        sl[++sl[0]] = node;
+        continue;
+      }
+
+      // full: keep the best of the old links and the new one
+      SparseRow row = training->row(s.second);
+      std::vector<Candidate> candidates(1, Candidate(s.first, node));
+      for(unsigned j = 1; j <= sl[0]; ++j)
+        candidates.push_back(Candidate(distance(row, training->row(sl[j])), sl[j]));
+
+      std::vector<Candidate> kept = select(candidates, max);
+      sl[0] = 0;
+      for(const auto& k : kept)
+        sl[++sl[0]] = k.second;
+    }
+  }
+
+  void insert(unsigned node)
+  {
+    int level = levels[node];
+    SparseRow q = training->row(node);
+
+    // a node becoming the new entry point holds the lock until it is linked
+    lock_type lock(entry_mutex);
+    int top = max_level;
+    unsigned ep = entry;
+    if(level <= top)
+      lock.unlock();
+
+    std::vector<Candidate> entries(1, Candidate(distance(q, training->row(ep)), ep));
+
+    for(int l = top; l > level; --l)
+      entries = search_layer(q, entries, 1, l, true);
+
+    for(int l = std::min(level, top); l >= 0; --l)
+    {
+      entries = search_layer(q, entries, ef_construction, l, true);
+      connect(node, l, select(entries, m));
+    }
+
+    if(level > top)
+    {
+      entry = node;
+      max_level = level;
+    }
+  }
+
+  // push the nodes nearest to query found by the graph search into topk
+  void search(const Query& query, TopK* topk) const
+  {
+    if(levels.empty())
+      return;
+
+    SparseRow q = query.row();
+    std::vector<Candidate> entries(1, Candidate(distance(q, training->row(entry)), entry));
+
+    for(int l = max_level; l > 0; --l)
+      entries = search_layer(q, entries, 1, l, false);
+
+    entries = search_layer(q, entries, std::max(ef_search, topk->k), 0, false);
+
+    for(const auto& e : entries)
+      topk->push(e.first, e.second);
+  }
+};
+
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <vector>
+
+#include "Example.hh"
+#include "TrainingSet.hh"
+#include "TopK.hh"
+
+namespace knn {
+
+// maps each feature id to the list of (row, value) pairs of the training
+// examples using it: the postings of feature f are
+// rows/values[offsets[f] .. offsets[f+1])
+// only the rows sharing at least one feature with a query are scored, the
+// others are at distance 1 and only fill the top-k after them when fewer
+// than k rows are scored or some are further than 1 (values can be
+// negative after normalisation), so that the search stays exact
+// the postings of the rows added after the build are kept apart, in
+// added[f] for feature f
+struct InvertedIndex
+{
+  typedef std::pair<unsigned, double> Posting;
+
+  std::vector<size_t> offsets;
+  std::vector<unsigned> rows;
+  std::vector<double> values;
+  std::vector<double> norms;
+  std::vector<std::vector<Posting> > added;
+
+  // per-thread scratch space for accumulating dot products,
+  // left zeroed between two searches
+  struct Accumulator
+  {
+    std::vector<double> scores;
+    std::vector<char> visited;
+    std::vector<unsigned> touched;
+
+    Accumulator() : scores(), visited(), touched() {};
+  };
+
+  InvertedIndex() : offsets(), rows(), values(), norms(), added() {};
+
+  void build(const TrainingSet& training)
+  {
+    unsigned num_features = 0;
+    for(const auto& id : training.feature_ids)
+      if(id >= num_features)
+        num_features = id + 1;
+
+    offsets.assign(num_features + 1, 0);
+    for(const auto& id : training.feature_ids)
+      ++offsets[id + 1];
+    for(unsigned f = 0; f < num_features; ++f)
+      offsets[f + 1] += offsets[f];
+
+    rows.resize(training.feature_ids.size());
+    values.resize(training.feature_ids.size());
+    norms.assign(training.size(), 0);
+    added.clear();
+
+    std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for(size_t r = 0; r < training.size(); ++r)
+    {
+      for(size_t j = training.row_begin(r); j < training.row_end(r); ++j)
+      {
+        size_t p = fill[training.feature_ids[j]]++;
+        rows[p] = r;
+        values[p] = training.values[j];
+      }
+      norms[r] = std::sqrt(training.squared_norms[r]);
+    }
+
+    fprintf(stderr, "inverted index built: %u features, %lu postings\n",
+            num_features, rows.size());
+  }
+
+  // index row r of training, appended after the build
+  void add(const TrainingSet& training, size_t r)
+  {
+    for(size_t j = training.row_begin(r); j < training.row_end(r); ++j)
+    {
+      unsigned id = training.feature_ids[j];
+      if(added.size() <= id)
+        added.resize(id + 1);
+      added[id].push_back(Posting(r, training.values[j]));
+    }
+    if(norms.size() <= r)
+      norms.resize(r + 1, 0);
+    norms[r] = std::sqrt(training.squared_norms[r]);
+  }
+
+  // push the candidates of example into topk
+  // (scores are cosine distances, as returned by compute_similarity)
+  void search(const Example& example, TopK* topk) const
+  {
+    static thread_local Accumulator acc;
+    if(acc.scores.size() < norms.size())
+    {
+      acc.scores.resize(norms.size(), 0);
+      acc.visited.resize(norms.size(), 0);
+    }
+    std::vector<double>& scores = acc.scores;
+    std::vector<char>& visited = acc.visited;
+    std::vector<unsigned>& touched = acc.touched;
+
+    double magthis = 0;
+    size_t pairs = 0;
+
+    for(const auto& f : example.features)
+    {
+      magthis += f.value * f.value;
+
+      if(f.id + 1 < offsets.size())
+      {
+        pairs += offsets[f.id + 1] - offsets[f.id];
+        for(size_t p = offsets[f.id]; p < offsets[f.id + 1]; ++p)
+        {
+          unsigned r = rows[p];
+          if(!visited[r])
+          {
+            visited[r] = 1;
+            touched.push_back(r);
+          }
+          scores[r] += f.value * values[p];
+        }
+      }
+
+      if(f.id >= added.size())
+        continue;
+      pairs += added[f.id].size();
+      for(const auto& p : added[f.id])
+      {
+        if(!visited[p.first])
+        {
+          visited[p.first] = 1;
+          touched.push_back(p.first);
+        }
+        scores[p.first] += f.value * p.second;
+      }
+    }
+
+    magthis = std::sqrt(magthis);
+    stats::count(stats::FEATURE_PAIRS, pairs);
+
+    for(const auto& r : touched)
+    {
+      double distance = 1 - scores[r] / (magthis * norms[r]);
+      scores[r] = 0;
+
+      topk->push(distance, r);
+    }
+
+    // the rows sharing no feature, in order: once the top-k is full of rows
+    // nearer than the next one, no later row can enter it
+    size_t scanned = touched.size();
+    for(size_t r = 0; r < norms.size(); ++r)
+    {
+      if(topk->full() && (topk->k == 0 || topk->heap.front() < Neighbour(1, r)))
+        break;
+      if(visited[r])
+        continue;
+      ++scanned;
+      topk->push(1 - 0 / (magthis * norms[r]), r);
+    }
+    stats::count(stats::EXAMPLES_SCANNED, scanned);
+
+    for(const auto& r : touched)
+      visited[r] = 0;
+    touched.clear();
+  }
+};
+
+}
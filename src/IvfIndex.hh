@@ -0,0 +1,316 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Example.hh"
+#include "TrainingSet.hh"
+#include "ThreadPool.hh"
+#include "TopK.hh"
+#include "Random.hh"
+
+namespace knn {
+
+// inverted file index: the rows are clustered by k-means (spherical
+// k-means, on unit centroids, for the cosine distance) and a query only
+// scans the rows of the nprobe lists whose centroids are nearest to it
+// the rows of list l are copied contiguously, in positions
+// list_offsets[l] .. list_offsets[l+1] of the index's own sparse rows,
+// rows[] giving their index in the training set; the rows added to the
+// training set after the build are in added[l], read in place
+// a centroid keeps only its features largest weights (in absolute value),
+// so that the centroids stay small on large vocabularies; they are laid
+// out by feature, postings[postings_offsets[f] ..] giving the lists whose
+// centroid has feature f, so that a row is scored against every list at
+// once in the time of walking the postings of its features
+struct IvfIndex
+{
+  typedef std::pair<unsigned, double> Weight;  // feature id, value
+
+  const TrainingSet* training;
+  bool spherical;
+  unsigned lists;
+  unsigned nprobe;
+  unsigned features;
+  size_t dimension;
+  std::vector<std::vector<Weight> > centroids;
+  std::vector<double> centroid_norms;  // squared
+  std::vector<size_t> postings_offsets;
+  std::vector<Weight> postings;        // list, value
+
+  std::vector<size_t> list_offsets;
+  std::vector<unsigned> rows;
+  std::vector<size_t> offsets;
+  std::vector<unsigned> feature_ids;
+  std::vector<double> values;
+  std::vector<double> squared_norms;
+  std::vector<std::vector<unsigned> > added;
+
+  IvfIndex() : training(NULL), spherical(false), lists(0), nprobe(0), features(0), dimension(0), centroids(),
+               centroid_norms(), postings_offsets(), postings(),
+               list_offsets(), rows(), offsets(), feature_ids(), values(), squared_norms(), added() {};
+
+  SparseRow row(size_t i) const
+  {
+    SparseRow r = { &feature_ids[offsets[i]], &values[offsets[i]], offsets[i + 1] - offsets[i],
+                    squared_norms[i] };
+    return r;
+  }
+
+  // the scores ranking the lists for a vector, lower is nearer
+  void centroid_scores(const SparseRow& r, double* scores) const
+  {
+    for(unsigned l = 0; l < lists; ++l)
+      scores[l] = spherical ? 0 : centroid_norms[l];
+    double factor = spherical ? -1 : -2;
+    for(size_t j = 0; j < r.size; ++j)
+      if(r.ids[j] < dimension)
+        for(size_t p = postings_offsets[r.ids[j]]; p < postings_offsets[r.ids[j] + 1]; ++p)
+          scores[postings[p].first] += factor * r.values[j] * postings[p].second;
+  }
+
+  unsigned nearest_list(const SparseRow& r) const
+  {
+    static thread_local std::vector<double> scores;
+    scores.resize(lists);
+    centroid_scores(r, &scores[0]);
+    return std::min_element(scores.begin(), scores.end()) - scores.begin();
+  }
+
+  // centroid l from the sum of its count rows: the mean (the unit mean if
+  // spherical) of its features largest weights
+  void set_centroid(unsigned l, std::vector<Weight>* sum, size_t count)
+  {
+    std::vector<Weight>& w = *sum;
+    if(w.size() > features)
+    {
+      std::nth_element(w.begin(), w.begin() + features, w.end(),
+                       [](const Weight& a, const Weight& b) { return std::fabs(a.second) > std::fabs(b.second); });
+      w.resize(features);
+    }
+    std::sort(w.begin(), w.end());
+
+    double norm = 0;
+    for(const auto& f : w)
+      norm += f.second * f.second;
+    double scale = 1.0 / count;
+    if(spherical)
+      scale = norm > 0 ? 1 / std::sqrt(norm) : 0;
+
+    for(auto& f : w)
+      f.second *= scale;
+    centroids[l].swap(w);
+    centroid_norms[l] = norm * scale * scale;
+  }
+
+  // lay the centroids out by feature
+  void index_centroids()
+  {
+    postings_offsets.assign(dimension + 1, 0);
+    for(const auto& c : centroids)
+      for(const auto& f : c)
+        ++postings_offsets[f.first + 1];
+    for(size_t d = 0; d < dimension; ++d)
+      postings_offsets[d + 1] += postings_offsets[d];
+
+    postings.resize(postings_offsets[dimension]);
+    std::vector<size_t> fill(postings_offsets.begin(), postings_offsets.end() - 1);
+    for(unsigned l = 0; l < lists; ++l)
+      for(const auto& f : centroids[l])
+        postings[fill[f.first]++] = Weight(l, f.second);
+  }
+
+  // centroids from the rows of each list, a list left empty keeps its centroid
+  void update_centroids(const TrainingSet& t, const std::vector<unsigned>& sample,
+                        const std::vector<unsigned>& assignment, ThreadPool* pool, int num_threads)
+  {
+    std::vector<std::vector<unsigned> > members(lists);
+    for(size_t s = 0; s < sample.size(); ++s)
+      members[assignment[s]].push_back(sample[s]);
+
+    pool->parallel_for(num_threads,
+                       [&](int i)
+                       {
+                         // the sums are dense, one vocabulary per thread
+                         std::vector<double> sum(dimension, 0.0);
+                         std::vector<unsigned> touched;
+                         std::vector<Weight> weights;
+                         for(unsigned l = i; l < lists; l += num_threads)
+                         {
+                           if(members[l].empty())
+                             continue;
+
+                           for(const auto& r : members[l])
+                             for(size_t j = t.row_begin(r); j < t.row_end(r); ++j)
+                             {
+                               if(sum[t.feature_ids[j]] == 0)
+                                 touched.push_back(t.feature_ids[j]);
+                               sum[t.feature_ids[j]] += t.values[j];
+                             }
+
+                           weights.clear();
+                           for(const auto& f : touched)
+                           {
+                             if(sum[f] != 0)
+                               weights.push_back(Weight(f, sum[f]));
+                             sum[f] = 0;
+                           }
+                           touched.clear();
+                           set_centroid(l, &weights, members[l].size());
+                         }
+                       }
+                       );
+    index_centroids();
+  }
+
+  void build(const TrainingSet& t, bool sph, unsigned num_lists, unsigned probes, unsigned iterations,
+             unsigned centroid_features, ThreadPool* pool, int num_threads)
+  {
+    size_t n = t.size();
+    training = &t;
+    spherical = sph;
+    nprobe = probes;
+    features = std::max(1u, centroid_features);
+    lists = num_lists ? num_lists : std::max(1u, unsigned(std::sqrt(double(n))));
+    lists = std::max(1u, std::min<unsigned>(lists, n));
+    std::vector<std::vector<unsigned> >(lists).swap(added);
+
+    dimension = 0;
+    for(const auto& id : t.feature_ids)
+      dimension = std::max<size_t>(dimension, id + 1);
+
+    if(n == 0)
+    {
+      lists = 0;
+      return;
+    }
+
+    // k-means runs on a sample of at most 64 rows per list, picked by hashing
+    std::vector<unsigned> sample;
+    size_t sample_size = std::min<size_t>(n, size_t(lists) * 64);
+    for(size_t r = 0; r < n; ++r)
+      if(uniform(mix64(r)) * n <= sample_size)
+        sample.push_back(r);
+    if(sample.empty())
+      sample.push_back(0);
+
+    // seeded with evenly spaced rows of the sample
+    std::vector<std::vector<Weight> >(lists).swap(centroids);
+    centroid_norms.assign(lists, 0);
+    for(unsigned l = 0; l < lists; ++l)
+    {
+      size_t seed = sample[size_t(l) * sample.size() / lists];
+      std::vector<Weight> weights;
+      for(size_t j = t.row_begin(seed); j < t.row_end(seed); ++j)
+        weights.push_back(Weight(t.feature_ids[j], t.values[j]));
+      set_centroid(l, &weights, 1);
+    }
+    index_centroids();
+
+    std::vector<unsigned> assignment(sample.size());
+    for(unsigned it = 0; it < iterations; ++it)
+    {
+      pool->parallel_for(num_threads,
+                         [&](int i)
+                         {
+                           for(size_t s = i * sample.size() / num_threads;
+                               s < (i+1) * sample.size() / num_threads; ++s)
+                             assignment[s] = nearest_list(t.row(sample[s]));
+                         }
+                         );
+      update_centroids(t, sample, assignment, pool, num_threads);
+    }
+
+    // every row goes to its nearest list, lists are laid out contiguously
+    std::vector<unsigned> list_of(n);
+    pool->parallel_for(num_threads,
+                       [&](int i)
+                       {
+                         for(size_t r = i * n / num_threads; r < (i+1) * n / num_threads; ++r)
+                           list_of[r] = nearest_list(t.row(r));
+                       }
+                       );
+
+    list_offsets.assign(lists + 1, 0);
+    for(const auto& l : list_of)
+      ++list_offsets[l + 1];
+    for(unsigned l = 0; l < lists; ++l)
+      list_offsets[l + 1] += list_offsets[l];
+
+    rows.resize(n);
+    std::vector<size_t> fill(list_offsets.begin(), list_offsets.end() - 1);
+    for(size_t r = 0; r < n; ++r)
+      rows[fill[list_of[r]]++] = r;
+
+    offsets.assign(1, 0);
+    feature_ids.clear();
+    values.clear();
+    squared_norms.clear();
+    offsets.reserve(n + 1);
+    feature_ids.reserve(t.feature_ids.size());
+    values.reserve(t.values.size());
+    squared_norms.reserve(n);
+    for(const auto& r : rows)
+    {
+      feature_ids.insert(feature_ids.end(),
+                         t.feature_ids.begin() + t.row_begin(r), t.feature_ids.begin() + t.row_end(r));
+      values.insert(values.end(), t.values.begin() + t.row_begin(r), t.values.begin() + t.row_end(r));
+      offsets.push_back(feature_ids.size());
+      squared_norms.push_back(t.squared_norms[r]);
+    }
+
+    fprintf(stderr, "ivf index built: %u lists, %lu dimensions, %lu centroid weights\n", lists, dimension,
+            postings.size());
+  }
+
+  // put row r of the training set, appended after the build, in its
+  // nearest list
+  void add(size_t r)
+  {
+    if(lists > 0)
+      added[nearest_list(training->row(r))].push_back(r);
+  }
+
+  // the nprobe lists nearest to query, nearest first
+  std::vector<unsigned> probe(const Query& query) const
+  {
+    SparseRow q = query.row();
+    std::vector<double> score(lists);
+    centroid_scores(q, &score[0]);
+    std::vector<std::pair<double, unsigned> > scores(lists);
+    for(unsigned l = 0; l < lists; ++l)
+      scores[l] = std::make_pair(score[l], l);
+
+    unsigned p = std::min(nprobe, lists);
+    std::partial_sort(scores.begin(), scores.begin() + p, scores.end());
+
+    std::vector<unsigned> res;
+    for(unsigned i = 0; i < p; ++i)
+      res.push_back(scores[i].second);
+    return res;
+  }
+
+  // push the rows of list l into topk
+  template<class Distance>
+  void scan(const Query& query, unsigned l, Distance distance, TopK* topk) const
+  {
+    SparseRow q = query.row();
+    for(size_t i = list_offsets[l]; i < list_offsets[l + 1]; ++i)
+      topk->push(distance(q, row(i)), rows[i]);
+    for(const auto& r : added[l])
+      topk->push(distance(q, training->row(r)), r);
+    stats::count(stats::EXAMPLES_SCANNED, list_offsets[l + 1] - list_offsets[l] + added[l].size());
+  }
+
+  template<class Distance>
+  void search(const Query& query, Distance distance, TopK* topk) const
+  {
+    if(lists == 0)
+      return;
+    for(const auto& l : probe(query))
+      scan(query, l, distance, topk);
+  }
+};
+
+}
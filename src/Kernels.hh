@@ -0,0 +1,308 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <cmath>
+#include <map>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KNN_X86_KERNELS
+#endif
+
+namespace knn {
+
+// a sparse vector seen as strictly increasing feature ids and their values,
+// with its squared euclidean norm computed beforehand
+struct SparseRow
+{
+  const unsigned* ids;
+  const double* values;
+  size_t size;
+  double squared_norm;
+};
+
+// a sparse vector whose values are stored in reduced precision (float or
+// int8); the squared norm is that of the values as stored
+template<class T>
+struct CompactRow
+{
+  const unsigned* ids;
+  const T* values;
+  size_t size;
+  double squared_norm;
+};
+
+namespace kernels {
+
+typedef double (*dot_kernel)(const SparseRow&, const SparseRow&);
+typedef double (*distance_function)(const SparseRow&, const SparseRow&);
+
+inline double squared_norm(const double* values, size_t size)
+{
+  double res = 0;
+  for(size_t i = 0; i < size; ++i)
+    res += values[i] * values[i];
+  return res;
+}
+
+// merge of the id lists from positions i and j, with the advance and the
+// accumulation done without branches
+template<class T>
+inline double dot_tail(const SparseRow& a, const unsigned* b_ids, const T* b_values, size_t b_size,
+                       size_t i, size_t j)
+{
+  double res = 0;
+  while(i < a.size && j < b_size)
+  {
+    unsigned x = a.ids[i], y = b_ids[j];
+    double p = a.values[i] * double(b_values[j]);
+    res += (x == y) ? p : 0.0;
+    i += (x <= y);
+    j += (y <= x);
+  }
+  return res;
+}
+
+inline double dot_tail(const SparseRow& a, const SparseRow& b, size_t i, size_t j)
+{
+  return dot_tail(a, b.ids, b.values, b.size, i, j);
+}
+
+inline double dot_scalar(const SparseRow& a, const SparseRow& b)
+{
+  return dot_tail(a, b, 0, 0);
+}
+
+#ifdef KNN_X86_KERNELS
+
+// the vector kernels compare a block of ids of a with every rotation of a
+// block of ids of b, multiply the values of the lanes found equal and
+// advance the block(s) with the smallest last id; the ends of the lists
+// shorter than a block are left to dot_tail
+
+__attribute__((target("sse4.2")))
+inline __m128d masked_product_sse42(__m128i mask, bool high, __m128d a, __m128d b)
+{
+  if(high)
+    mask = _mm_srli_si128(mask, 8);
+  return _mm_and_pd(_mm_castsi128_pd(_mm_cvtepi32_epi64(mask)), _mm_mul_pd(a, b));
+}
+
+__attribute__((target("sse4.2")))
+inline double dot_sse42(const SparseRow& a, const SparseRow& b)
+{
+  size_t i = 0, j = 0;
+  size_t na = a.size & ~size_t(3), nb = b.size & ~size_t(3);
+  __m128d acc = _mm_setzero_pd();
+
+  while(i < na && j < nb)
+  {
+    __m128i ia = _mm_loadu_si128((const __m128i*) (a.ids + i));
+    __m128i ib = _mm_loadu_si128((const __m128i*) (b.ids + j));
+    __m128d a01 = _mm_loadu_pd(a.values + i), a23 = _mm_loadu_pd(a.values + i + 2);
+    __m128d b01 = _mm_loadu_pd(b.values + j), b23 = _mm_loadu_pd(b.values + j + 2);
+    __m128d b12 = _mm_shuffle_pd(b01, b23, 1), b30 = _mm_shuffle_pd(b23, b01, 1);
+
+    __m128i m = _mm_cmpeq_epi32(ia, ib);
+    acc = _mm_add_pd(acc, masked_product_sse42(m, false, a01, b01));
+    acc = _mm_add_pd(acc, masked_product_sse42(m, true, a23, b23));
+
+    m = _mm_cmpeq_epi32(ia, _mm_shuffle_epi32(ib, _MM_SHUFFLE(0,3,2,1)));
+    acc = _mm_add_pd(acc, masked_product_sse42(m, false, a01, b12));
+    acc = _mm_add_pd(acc, masked_product_sse42(m, true, a23, b30));
+
+    m = _mm_cmpeq_epi32(ia, _mm_shuffle_epi32(ib, _MM_SHUFFLE(1,0,3,2)));
+    acc = _mm_add_pd(acc, masked_product_sse42(m, false, a01, b23));
+    acc = _mm_add_pd(acc, masked_product_sse42(m, true, a23, b01));
+
+    m = _mm_cmpeq_epi32(ia, _mm_shuffle_epi32(ib, _MM_SHUFFLE(2,1,0,3)));
+    acc = _mm_add_pd(acc, masked_product_sse42(m, false, a01, b30));
+    acc = _mm_add_pd(acc, masked_product_sse42(m, true, a23, b12));
+
+    unsigned amax = a.ids[i + 3], bmax = b.ids[j + 3];
+    i += (amax <= bmax) ? 4 : 0;
+    j += (bmax <= amax) ? 4 : 0;
+  }
+
+  double res[2];
+  _mm_storeu_pd(res, acc);
+  return res[0] + res[1] + dot_tail(a, b, i, j);
+}
+
+__attribute__((target("avx2")))
+inline __m256d masked_product_avx2(__m128i ia, __m128i ib, __m256d a, __m256d b)
+{
+  __m256d mask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpeq_epi32(ia, ib)));
+  return _mm256_and_pd(mask, _mm256_mul_pd(a, b));
+}
+
+// four values widened to doubles
+__attribute__((target("avx2")))
+inline __m256d load4_avx2(const double* p)
+{
+  return _mm256_loadu_pd(p);
+}
+
+__attribute__((target("avx2")))
+inline __m256d load4_avx2(const float* p)
+{
+  return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+__attribute__((target("avx2")))
+inline __m256d load4_avx2(const int8_t* p)
+{
+  int32_t x;
+  memcpy(&x, p, sizeof(x));
+  return _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(x)));
+}
+
+template<class T>
+__attribute__((target("avx2")))
+inline double dot_avx2_blocks(const SparseRow& a, const unsigned* b_ids, const T* b_values, size_t b_size)
+{
+  size_t i = 0, j = 0;
+  size_t na = a.size & ~size_t(3), nb = b_size & ~size_t(3);
+  __m256d acc = _mm256_setzero_pd();
+
+  while(i < na && j < nb)
+  {
+    __m128i ia = _mm_loadu_si128((const __m128i*) (a.ids + i));
+    __m128i ib = _mm_loadu_si128((const __m128i*) (b_ids + j));
+    __m256d va = _mm256_loadu_pd(a.values + i);
+    __m256d vb = load4_avx2(b_values + j);
+
+    acc = _mm256_add_pd(acc, masked_product_avx2(ia, ib, va, vb));
+    acc = _mm256_add_pd(acc, masked_product_avx2(ia, _mm_shuffle_epi32(ib, _MM_SHUFFLE(0,3,2,1)),
+                                                 va, _mm256_permute4x64_pd(vb, _MM_SHUFFLE(0,3,2,1))));
+    acc = _mm256_add_pd(acc, masked_product_avx2(ia, _mm_shuffle_epi32(ib, _MM_SHUFFLE(1,0,3,2)),
+                                                 va, _mm256_permute4x64_pd(vb, _MM_SHUFFLE(1,0,3,2))));
+    acc = _mm256_add_pd(acc, masked_product_avx2(ia, _mm_shuffle_epi32(ib, _MM_SHUFFLE(2,1,0,3)),
+                                                 va, _mm256_permute4x64_pd(vb, _MM_SHUFFLE(2,1,0,3))));
+
+    unsigned amax = a.ids[i + 3], bmax = b_ids[j + 3];
+    i += (amax <= bmax) ? 4 : 0;
+    j += (bmax <= amax) ? 4 : 0;
+  }
+
+  double res[4];
+  _mm256_storeu_pd(res, acc);
+  return res[0] + res[1] + res[2] + res[3] + dot_tail(a, b_ids, b_values, b_size, i, j);
+}
+
+__attribute__((target("avx2")))
+inline double dot_avx2(const SparseRow& a, const SparseRow& b)
+{
+  return dot_avx2_blocks(a, b.ids, b.values, b.size);
+}
+
+__attribute__((target("avx512f,avx512vl")))
+inline double dot_avx512(const SparseRow& a, const SparseRow& b)
+{
+  size_t i = 0, j = 0;
+  size_t na = a.size & ~size_t(7), nb = b.size & ~size_t(7);
+  __m512d acc = _mm512_setzero_pd();
+  const __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i seven = _mm256_set1_epi32(7);
+
+  while(i < na && j < nb)
+  {
+    __m256i ia = _mm256_loadu_si256((const __m256i*) (a.ids + i));
+    __m256i ib = _mm256_loadu_si256((const __m256i*) (b.ids + j));
+    __m512d va = _mm512_loadu_pd(a.values + i);
+    __m512d vb = _mm512_loadu_pd(b.values + j);
+
+    for(int r = 0; r < 8; ++r)
+    {
+      __m256i rotation = _mm256_and_si256(_mm256_add_epi32(iota, _mm256_set1_epi32(r)), seven);
+      __mmask8 m = _mm256_cmpeq_epi32_mask(ia, _mm256_permutevar8x32_epi32(ib, rotation));
+      __m512d vbr = _mm512_maskz_permutexvar_pd(0xff, _mm512_maskz_cvtepi32_epi64(0xff, rotation), vb);
+      acc = _mm512_mask_add_pd(acc, m, acc, _mm512_mul_pd(va, vbr));
+    }
+
+    unsigned amax = a.ids[i + 7], bmax = b.ids[j + 7];
+    i += (amax <= bmax) ? 8 : 0;
+    j += (bmax <= amax) ? 8 : 0;
+  }
+
+  double res[8];
+  _mm512_storeu_pd(res, acc);
+  return res[0] + res[1] + res[2] + res[3] + res[4] + res[5] + res[6] + res[7] + dot_tail(a, b, i, j);
+}
+
+#endif
+
+// the dot product kernels usable on this cpu, by name
+inline std::map<std::string, dot_kernel> available_dots()
+{
+  std::map<std::string, dot_kernel> res;
+  res["scalar"] = dot_scalar;
+#ifdef KNN_X86_KERNELS
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2"))
+    res["sse4.2"] = dot_sse42;
+  if(__builtin_cpu_supports("avx2"))
+    res["avx2"] = dot_avx2;
+  if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+    res["avx512"] = dot_avx512;
+#endif
+  return res;
+}
+
+// the fastest kernel supported: the 8-wide avx512 blocks are rarely full
+// on short rows, so avx2 comes first
+inline dot_kernel select_dot()
+{
+  std::map<std::string, dot_kernel> kernels = available_dots();
+  const char* preference[] = {"avx2", "avx512", "sse4.2"};
+  for(const auto& name : preference)
+    if(kernels.count(name))
+      return kernels[name];
+  return dot_scalar;
+}
+
+dot_kernel dot = select_dot();
+
+// squared euclidean distance, as ||a||^2 + ||b||^2 - 2 a.b
+inline double euclidean(const SparseRow& a, const SparseRow& b)
+{
+  double res = a.squared_norm + b.squared_norm - 2 * dot(a, b);
+  return res < 0 ? 0 : res;
+}
+
+// cosine distance, 1 - cos(a, b)
+inline double cosine(const SparseRow& a, const SparseRow& b)
+{
+  return 1 - dot(a, b) / std::sqrt(a.squared_norm * b.squared_norm);
+}
+
+// the same against a row stored in reduced precision, with the avx2
+// blocks whenever a vector kernel was selected
+template<class T>
+inline double dot_compact(const SparseRow& a, const CompactRow<T>& b)
+{
+#ifdef KNN_X86_KERNELS
+  if(dot == dot_avx2 || dot == dot_avx512)
+    return dot_avx2_blocks(a, b.ids, b.values, b.size);
+#endif
+  return dot_tail(a, b.ids, b.values, b.size, 0, 0);
+}
+
+template<class T>
+inline double euclidean_compact(const SparseRow& a, const CompactRow<T>& b)
+{
+  double res = a.squared_norm + b.squared_norm - 2 * dot_compact(a, b);
+  return res < 0 ? 0 : res;
+}
+
+template<class T>
+inline double cosine_compact(const SparseRow& a, const CompactRow<T>& b)
+{
+  return 1 - dot_compact(a, b) / std::sqrt(a.squared_norm * b.squared_norm);
+}
+
+}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <algorithm>
+#include <functional>
+
+#include "TrainingSet.hh"
+#include "TopK.hh"
+#include "ThreadPool.hh"
+
+namespace knn {
+
+// the k nearest neighbours of every training row among the other rows,
+// by a blocked self-join, passed on tile by tile as they are complete:
+// - the rows are cut into tiles of about tile_bytes of features, a pair
+//   of tiles stays in cache while each row of one is compared with each
+//   row of the other
+// - a distance is computed once for the two rows it joins and pushed into
+//   the heaps of both, so only the pairs of tiles i <= j are joined
+// - step i joins tile i with every tile j >= i; the rows of tile i have
+//   then met every other row, their lists are passed on in row order and
+//   their heaps freed, so only the heaps of the tiles after i are held
+// - the workers take the pairs of a step from a shared counter, one at a
+//   time; each pair is alone to push into the heaps of its tile j, those of
+//   tile i are kept per worker and merged at the end of the step
+struct KnnGraph
+{
+  std::vector<TopK> heaps;  // by row, empty once the row is passed on
+
+  KnnGraph() : heaps() {};
+
+  template<class Distance>
+  void build(const TrainingSet& t, unsigned k, Distance distance, size_t tile_bytes,
+             ThreadPool* pool, int num_threads,
+             const std::function<void(size_t, const std::vector<Neighbour>&)>& done)
+  {
+    heaps.assign(t.size(), TopK(k));
+    if(t.size() == 0)
+      return;
+
+    // tile i holds the rows [tiles[i], tiles[i+1])
+    std::vector<size_t> tiles(1, 0);
+    size_t bytes = 0;
+    for(size_t r = 0; r < t.size(); ++r)
+    {
+      bytes += (t.row_end(r) - t.row_begin(r)) * (sizeof(unsigned) + sizeof(double));
+      if(bytes >= tile_bytes || r + 1 == t.size())
+      {
+        tiles.push_back(r + 1);
+        bytes = 0;
+      }
+    }
+    size_t num_tiles = tiles.size() - 1;
+
+    std::vector<std::vector<TopK> > local(num_threads);
+    std::vector<TopK> parts;
+
+    for(size_t i = 0; i < num_tiles; ++i)
+    {
+      size_t begin = tiles[i], end = tiles[i + 1];
+      for(auto& l : local)
+        l.assign(end - begin, TopK(k));
+
+      std::atomic<size_t> next(i);
+      pool->parallel_for(num_threads,
+                         [&](int w)
+                         {
+                           for(size_t j = next++; j < num_tiles; j = next++)
+                             join(t, distance, begin, end, tiles[j], tiles[j + 1], &local[w]);
+                         }
+                         );
+
+      for(size_t r = begin; r < end; ++r)
+      {
+        parts.clear();
+        parts.push_back(heaps[r]);
+        for(const auto& l : local)
+          parts.push_back(l[r - begin]);
+        heaps[r] = TopK(0);
+        done(r, merge(parts, k));
+      }
+    }
+  }
+
+  // every row of [a_begin, a_end) against every row of [b_begin, b_end)
+  // after it, a_end <= b_begin unless the two are the same tile; the rows
+  // of the first tile push into a_heaps, by row from a_begin
+  template<class Distance>
+  void join(const TrainingSet& t, Distance distance,
+            size_t a_begin, size_t a_end, size_t b_begin, size_t b_end, std::vector<TopK>* a_heaps)
+  {
+    for(size_t a = a_begin; a < a_end; ++a)
+    {
+      SparseRow row = t.row(a);
+      TopK& heap = (*a_heaps)[a - a_begin];
+      for(size_t b = std::max(b_begin, a + 1); b < b_end; ++b)
+      {
+        double d = distance(row, t.row(b));
+        heap.push(d, b);
+        (b < a_end ? (*a_heaps)[b - a_begin] : heaps[b]).push(d, a);
+      }
+    }
+  }
+};
+
+}
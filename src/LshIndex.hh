@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Example.hh"
+#include "TrainingSet.hh"
+#include "ThreadPool.hh"
+#include "TopK.hh"
+#include "Random.hh"
+
+namespace knn {
+
+// random hyperplane (SimHash) signatures for approximate cosine search:
+// each of the tables hashes a row to the signs of its projections on
+// bits hyperplanes, rows sharing a bucket with a query in any table are
+// reranked with the exact cosine distance
+// a query also probes, in each table, the buckets of the probes keys
+// one bit away from its own, on the bits whose projection is nearest
+// to 0 (multi-probe): sparse vectors rarely agree on every bit, and
+// these buckets are the next most likely to hold its neighbours
+// the hyperplanes are never stored: the component of hyperplane b of
+// table t for feature f is +1 or -1 as bit b of mix(t, f)
+// the buckets of table t are rows[t * n .. (t+1) * n), sorted by key;
+// the rows added after the build are in added[t], also sorted by key
+struct LshIndex
+{
+  typedef std::pair<uint64_t, unsigned> Entry;
+
+  unsigned tables;
+  unsigned bits;
+  unsigned probes;
+  size_t n;
+  std::vector<uint64_t> keys;
+  std::vector<unsigned> rows;
+  std::vector<std::vector<Entry> > added;
+  const TrainingSet* training;
+
+  // per-thread marks of the rows already reranked, left cleared between two searches
+  struct Candidates
+  {
+    std::vector<char> visited;
+    std::vector<unsigned> touched;
+
+    Candidates() : visited(), touched() {};
+  };
+
+  LshIndex() : tables(0), bits(0), probes(0), n(0), keys(), rows(), added(), training(NULL) {};
+
+  static inline uint64_t mix(uint64_t table, uint64_t feature)
+  {
+    return mix64(table << 32 | feature);
+  }
+
+  // the projections of a sparse vector on the hyperplanes of table t
+  void project(const SparseRow& row, unsigned t, double* sums) const
+  {
+    std::fill(sums, sums + bits, 0.0);
+    for(size_t j = 0; j < row.size; ++j)
+    {
+      uint64_t h = mix(t, row.ids[j]);
+      double v = row.values[j];
+      for(unsigned b = 0; b < bits; ++b)
+        sums[b] += ((h >> b) & 1) ? v : -v;
+    }
+  }
+
+  uint64_t key(const double* sums) const
+  {
+    uint64_t res = 0;
+    for(unsigned b = 0; b < bits; ++b)
+      res |= uint64_t(sums[b] > 0) << b;
+    return res;
+  }
+
+  // the key of a sparse vector in table t
+  uint64_t signature(const SparseRow& row, unsigned t) const
+  {
+    double sums[64];
+    project(row, t, sums);
+    return key(sums);
+  }
+
+  void build(const TrainingSet& t, unsigned num_tables, unsigned num_bits, unsigned num_probes,
+             ThreadPool* pool, int num_threads)
+  {
+    training = &t;
+    tables = num_tables;
+    bits = std::min(num_bits, 64u);
+    probes = std::min(num_probes, bits);
+    n = t.size();
+
+    keys.resize(tables * n);
+    rows.resize(tables * n);
+    std::vector<std::vector<Entry> >(tables).swap(added);
+
+    std::vector<uint64_t> signatures(tables * n);
+    pool->parallel_for(num_threads,
+                       [&](int i)
+                       {
+                         for(size_t r = i * n / num_threads; r < (i+1) * n / num_threads; ++r)
+                           for(unsigned tb = 0; tb < tables; ++tb)
+                             signatures[tb * n + r] = signature(t.row(r), tb);
+                       }
+                       );
+
+    pool->parallel_for(num_threads,
+                       [&](int i)
+                       {
+                         std::vector<std::pair<uint64_t, unsigned> > bucket(n);
+                         for(unsigned tb = i; tb < tables; tb += num_threads)
+                         {
+                           for(size_t r = 0; r < n; ++r)
+                             bucket[r] = std::make_pair(signatures[tb * n + r], (unsigned) r);
+                           std::sort(bucket.begin(), bucket.end());
+                           for(size_t r = 0; r < n; ++r)
+                           {
+                             keys[tb * n + r] = bucket[r].first;
+                             rows[tb * n + r] = bucket[r].second;
+                           }
+                         }
+                       }
+                       );
+
+    fprintf(stderr, "lsh index built: %u tables of %u bits, %u probes\n", tables, bits, probes);
+  }
+
+  // index row r of the training set, appended after the build
+  void add(size_t r)
+  {
+    for(unsigned t = 0; t < tables; ++t)
+    {
+      Entry e(signature(training->row(r), t), r);
+      added[t].insert(std::upper_bound(added[t].begin(), added[t].end(), e), e);
+    }
+  }
+
+  // push the candidates of query into topk, with their exact cosine distance
+  void search(const Query& query, TopK* topk) const
+  {
+    static thread_local Candidates candidates;
+    if(candidates.visited.size() < training->size())
+      candidates.visited.resize(training->size(), 0);
+    std::vector<char>& visited = candidates.visited;
+    std::vector<unsigned>& touched = candidates.touched;
+
+    SparseRow q = query.row();
+    double sums[64];
+    unsigned order[64];
+
+    for(unsigned t = 0; t < tables; ++t)
+    {
+      project(q, t, sums);
+      uint64_t k = key(sums);
+      probe(q, t, k, &candidates, topk);
+
+      for(unsigned b = 0; b < bits; ++b)
+        order[b] = b;
+      std::partial_sort(order, order + probes, order + bits,
+                        [&sums](unsigned a, unsigned b) { return std::fabs(sums[a]) < std::fabs(sums[b]); });
+      for(unsigned p = 0; p < probes; ++p)
+        probe(q, t, k ^ (uint64_t(1) << order[p]), &candidates, topk);
+    }
+
+    stats::count(stats::EXAMPLES_SCANNED, touched.size());
+    for(const auto& r : touched)
+      visited[r] = 0;
+    touched.clear();
+  }
+
+  // push the rows of the bucket key of table t not yet visited
+  void probe(const SparseRow& q, unsigned t, uint64_t key, Candidates* candidates, TopK* topk) const
+  {
+    std::vector<char>& visited = candidates->visited;
+    std::vector<unsigned>& touched = candidates->touched;
+
+    auto range = std::equal_range(keys.begin() + t * n, keys.begin() + (t+1) * n, key);
+    for(auto k = range.first; k != range.second; ++k)
+    {
+      unsigned r = rows[k - keys.begin()];
+      if(!visited[r])
+      {
+        visited[r] = 1;
+        touched.push_back(r);
+        topk->push(kernels::cosine(q, training->row(r)), r);
+      }
+    }
+
+    for(auto e = std::lower_bound(added[t].begin(), added[t].end(), Entry(key, 0));
+        e != added[t].end() && e->first == key; ++e)
+      if(!visited[e->second])
+      {
+        visited[e->second] = 1;
+        touched.push_back(e->second);
+        topk->push(kernels::cosine(q, training->row(e->second)), e->second);
+      }
+  }
+};
+
+}
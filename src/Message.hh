@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <cerrno>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace knn {
+
+// a message between processes on a stream socket: values in native byte
+// order (both ends run on the same machine), sent after their length;
+// read_* calls past the end or on a failed message leave ok unset
+struct Message
+{
+  std::string data;
+  size_t position;
+  bool ok;
+
+  Message() : data(), position(0), ok(true) {};
+
+  void write(const void* p, size_t bytes)
+  {
+    data.append((const char*) p, bytes);
+  }
+
+  template<class T>
+  void write_value(const T& v)
+  {
+    write(&v, sizeof(T));
+  }
+
+  template<class T>
+  void write_vector(const std::vector<T>& v)
+  {
+    write_value<uint64_t>(v.size());
+    write(v.data(), v.size() * sizeof(T));
+  }
+
+  void write_string(const std::string& s)
+  {
+    write_value<uint64_t>(s.size());
+    write(s.data(), s.size());
+  }
+
+  void write_strings(const std::vector<std::string>& v)
+  {
+    write_value<uint64_t>(v.size());
+    for(const auto& s : v)
+      write_string(s);
+  }
+
+  bool read(void* p, size_t bytes)
+  {
+    if(!ok || bytes > data.size() - position)
+    {
+      ok = false;
+      return false;
+    }
+    memcpy(p, data.data() + position, bytes);
+    position += bytes;
+    return true;
+  }
+
+  template<class T>
+  T read_value()
+  {
+    T v = T();
+    read(&v, sizeof(T));
+    return v;
+  }
+
+  template<class T>
+  void read_vector(std::vector<T>* v)
+  {
+    uint64_t n = read_value<uint64_t>();
+    if(!ok || n > (data.size() - position) / sizeof(T))
+    {
+      ok = false;
+      return;
+    }
+    v->resize(n);
+    read(v->data(), n * sizeof(T));
+  }
+
+  std::string read_string()
+  {
+    uint64_t n = read_value<uint64_t>();
+    if(!ok || n > data.size() - position)
+    {
+      ok = false;
+      return std::string();
+    }
+    std::string res(data, position, n);
+    position += n;
+    return res;
+  }
+
+  void read_strings(std::vector<std::string>* v)
+  {
+    uint64_t n = read_value<uint64_t>();
+    v->clear();
+    for(uint64_t i = 0; ok && i < n; ++i)
+      v->push_back(read_string());
+  }
+
+  bool send(int fd) const
+  {
+    uint64_t length = data.size();
+    return send_all(fd, &length, sizeof(length)) && send_all(fd, data.data(), data.size());
+  }
+
+  // replaces the content, false at the end of the stream or on an error
+  bool receive(int fd)
+  {
+    uint64_t length = 0;
+    position = 0;
+    ok = receive_all(fd, &length, sizeof(length));
+    if(ok)
+    {
+      data.resize(length);
+      ok = receive_all(fd, &data[0], length);
+    }
+    return ok;
+  }
+
+  static bool send_all(int fd, const void* p, size_t bytes)
+  {
+    const char* c = (const char*) p;
+    while(bytes)
+    {
+      ssize_t n = ::send(fd, c, bytes, MSG_NOSIGNAL);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      c += n;
+      bytes -= n;
+    }
+    return true;
+  }
+
+  static bool receive_all(int fd, void* p, size_t bytes)
+  {
+    char* c = (char*) p;
+    while(bytes)
+    {
+      ssize_t n = ::read(fd, c, bytes);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      c += n;
+      bytes -= n;
+    }
+    return true;
+  }
+};
+
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Array.hh"
+
+#define MODEL_MAGIC "KNNMODEL"
+#define MODEL_VERSION 2
+
+namespace knn {
+
+// a binary model is a ModelHeader followed by arrays in native byte order,
+// each starting on an 8 byte boundary so that they can be used in place
+// once the file is mapped:
+//   offsets, feature_ids, values, squared_norms  (the training set)
+//   categories                                   (category index by row)
+//   ids, category names                          (string tables)
+//   dictionary                                   (feature names by id)
+//   counts                                       (feature counts by id)
+//   normaliser statistics
+struct ModelHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t size_of_size_t;
+  char normaliser[16];
+  uint64_t rows;
+  uint64_t features;
+  uint64_t dictionary;
+  uint64_t categories;
+  double count_total;
+};
+
+struct ModelWriter
+{
+  FILE* fp;
+  bool ok;
+
+  ModelWriter(const std::string& filename) : fp(fopen(filename.c_str(), "wb")), ok(fp != NULL) {};
+
+  ~ModelWriter() { close(); }
+
+  bool close()
+  {
+    if(fp && fclose(fp) != 0)
+      ok = false;
+    fp = NULL;
+    return ok;
+  }
+
+  void write(const void* p, size_t bytes)
+  {
+    static const char zeros[8] = {0};
+    size_t padding = (8 - bytes % 8) % 8;
+
+    if(!ok)
+      return;
+    if((bytes && fwrite(p, 1, bytes, fp) != bytes) ||
+       (padding && fwrite(zeros, 1, padding, fp) != padding))
+      ok = false;
+  }
+
+  template<class T>
+  void write_array(const Array<T>& a)
+  {
+    write(a.data(), a.size() * sizeof(T));
+  }
+
+  void write_vector(const std::vector<double>& v)
+  {
+    uint64_t n = v.size();
+    write(&n, sizeof(n));
+    write(v.data(), n * sizeof(double));
+  }
+
+  void write_strings(const StringTable& t)
+  {
+    uint64_t n = t.chars.size();
+    write(&n, sizeof(n));
+    write_array(t.offsets);
+    write_array(t.chars);
+  }
+};
+
+// a file mapped read-only in memory, unmapped on destruction; read()
+// walks a model file array by array
+struct MappedFile
+{
+  char* address;
+  size_t length;
+  size_t position;
+  bool ok;
+
+  MappedFile() : address(NULL), length(0), position(0), ok(false) {};
+
+  ~MappedFile()
+  {
+    if(address)
+      munmap(address, length);
+  }
+
+  bool open(const std::string& filename)
+  {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd == -1)
+      return false;
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p != MAP_FAILED)
+      {
+        address = (char*) p;
+        length = st.st_size;
+        position = 0;
+        ok = true;
+      }
+    }
+    ::close(fd);
+    return ok;
+  }
+
+  const void* read(size_t bytes)
+  {
+    if(!ok || position + bytes > length)
+    {
+      ok = false;
+      return NULL;
+    }
+    const void* p = address + position;
+    position += bytes + (8 - bytes % 8) % 8;
+    return p;
+  }
+
+  template<class T>
+  void read_array(Array<T>* a, size_t n)
+  {
+    const T* p = (const T*) read(n * sizeof(T));
+    if(p)
+      a->view(p, n);
+  }
+
+  void read_vector(std::vector<double>* v)
+  {
+    const uint64_t* n = (const uint64_t*) read(sizeof(uint64_t));
+    if(!n)
+      return;
+    const double* p = (const double*) read(*n * sizeof(double));
+    if(p)
+      v->assign(p, p + *n);
+  }
+
+  void read_strings(StringTable* t, size_t n)
+  {
+    const uint64_t* chars = (const uint64_t*) read(sizeof(uint64_t));
+    if(!chars)
+      return;
+    read_array(&t->offsets, n + 1);
+    read_array(&t->chars, *chars);
+  }
+};
+
+}
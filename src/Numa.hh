@@ -0,0 +1,237 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <sched.h>
+
+#include "TrainingSet.hh"
+#include "ThreadPool.hh"
+
+namespace knn {
+
+// "0-3,8,10-11" as 0 1 2 3 8 10 11
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+  std::vector<int> res;
+  const char* p = list.c_str();
+  while(*p)
+  {
+    int first, last, n = 0;
+    if(sscanf(p, "%d%n", &first, &n) != 1)
+      break;
+    p += n;
+    last = first;
+    if(*p == '-')
+    {
+      if(sscanf(p + 1, "%d%n", &last, &n) != 1)
+        break;
+      p += 1 + n;
+    }
+    for(int c = first; c <= last; ++c)
+      res.push_back(c);
+    if(*p == ',')
+      ++p;
+  }
+  return res;
+}
+
+inline std::string read_first_line(const std::string& filename)
+{
+  std::string res;
+  FILE* fp = fopen(filename.c_str(), "r");
+  if(!fp)
+    return res;
+  for(int c = fgetc(fp); c != EOF && c != '\n'; c = fgetc(fp))
+    res += c;
+  fclose(fp);
+  return res;
+}
+
+// the numa nodes with cpus the process may run on, and those cpus, from
+// /sys/devices/system/node; a single node 0 of the cpus of the
+// process where the topology is not available (without cpus if the
+// affinity of the process is not either)
+inline std::vector<std::pair<int, std::vector<int> > > numa_nodes()
+{
+  std::vector<std::pair<int, std::vector<int> > > res;
+
+  cpu_set_t allowed;
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    CPU_ZERO(&allowed);
+
+  for(const auto& node : parse_cpu_list(read_first_line("/sys/devices/system/node/online")))
+  {
+    std::vector<int> cpus;
+    for(const auto& c : parse_cpu_list(read_first_line("/sys/devices/system/node/node" +
+                                                       std::to_string(node) + "/cpulist")))
+      if(c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+        cpus.push_back(c);
+    if(!cpus.empty())
+      res.push_back(std::make_pair(node, cpus));
+  }
+
+  if(res.empty())
+  {
+    std::vector<int> cpus;
+    for(int c = 0; c < CPU_SETSIZE; ++c)
+      if(CPU_ISSET(c, &allowed))
+        cpus.push_back(c);
+    res.push_back(std::make_pair(0, cpus));
+  }
+  return res;
+}
+
+// the training rows split between the numa nodes for the exact scan:
+// - each node has workers pinned to its cpus, as many as its share of
+//   the threads (by its number of cpus), and a part of the rows as large
+//   as its share of the workers
+// - a part is a copy made by a worker of its node, its pages are
+//   allocated on the node as they are first written; the features of the
+//   training set are then released, the parts hold the only copy
+// - a scan runs on every worker at once, each on a slice of the part of
+//   its node, and keeps its own top-k
+// rows inserted after build go to the last part, the next build spreads
+// them again
+struct NumaStore
+{
+  struct Node
+  {
+    int id;
+    int workers;
+    int first_worker;
+    ThreadPool* pool;
+    size_t begin;       // training row of the first row of the part
+    TrainingSet rows;   // the part
+
+    Node(int i, int w, int first, const std::vector<int>& cpus)
+        : id(i), workers(w), first_worker(first), pool(new ThreadPool(w, cpus)), begin(0), rows() {};
+
+    ~Node() { delete pool; }
+  };
+
+  std::vector<Node*> nodes;
+  int num_workers;
+  size_t rows;
+
+  NumaStore() : nodes(), num_workers(0), rows(0) {};
+
+  ~NumaStore()
+  {
+    for(auto& n : nodes)
+      delete n;
+  }
+
+  // spread num_threads workers over the nodes
+  void init(int num_threads)
+  {
+    std::vector<std::pair<int, std::vector<int> > > topology = numa_nodes();
+    size_t cpus = 0;
+    for(const auto& n : topology)
+      cpus += n.second.size();
+
+    size_t seen = 0;
+    for(const auto& n : topology)
+    {
+      // without any cpu known, a single node of unpinned workers
+      int w = cpus ? (seen + n.second.size()) * num_threads / cpus - seen * num_threads / cpus : num_threads;
+      seen += n.second.size();
+      if(w > 0)
+      {
+        nodes.push_back(new Node(n.first, w, num_workers, n.second));
+        num_workers += w;
+      }
+    }
+  }
+
+  int workers() const { return num_workers; }
+
+  // move the features of training to the parts, each on its node
+  void build(TrainingSet* t)
+  {
+    const TrainingSet& training = *t;
+    rows = training.size();
+    std::vector<int> pending(nodes.size());
+    std::vector<std::function<void(int)> > copies;
+    copies.reserve(nodes.size());
+
+    for(size_t n = 0; n < nodes.size(); ++n)
+    {
+      Node* node = nodes[n];
+      node->begin = node->first_worker * rows / num_workers;
+      size_t end = (node->first_worker + node->workers) * rows / num_workers;
+      copies.push_back([&training, node, end](int)
+                       {
+                         node->rows = TrainingSet();
+                         node->rows.append(training, node->begin, end);
+                       });
+      node->pool->submit(1, copies.back(), &pending[n]);
+    }
+
+    for(size_t n = 0; n < nodes.size(); ++n)
+    {
+      nodes[n]->pool->wait(&pending[n]);
+      fprintf(stderr, "numa node %d: %d threads, rows %lu to %lu\n", nodes[n]->id, nodes[n]->workers,
+              nodes[n]->begin, nodes[n]->begin + nodes[n]->rows.size());
+    }
+    t->release_features();
+  }
+
+  // row r < rows of the training set, from the part holding it
+  SparseRow row(size_t r) const
+  {
+    size_t n = nodes.size() - 1;
+    while(nodes[n]->begin > r)
+      --n;
+    return nodes[n]->rows.row(r - nodes[n]->begin);
+  }
+
+  // append a row to the last part, by a worker of its node
+  void add(const Example& e)
+  {
+    Node* node = nodes.back();
+    int pending;
+    std::function<void(int)> append = [node, &e](int) { node->rows.add(e); };
+    node->pool->submit(1, append, &pending);
+    node->pool->wait(&pending);
+    ++rows;
+  }
+
+  // f(worker, node, begin, end) on every worker, from 0 to workers() - 1,
+  // with the rows [begin, end) of the part of its node
+  void parallel_for(const std::function<void(int, const Node&, size_t, size_t)>& f) const
+  {
+    std::vector<int> pending(nodes.size());
+    std::vector<std::function<void(int)> > slices;
+    slices.reserve(nodes.size());
+
+    for(size_t n = 0; n < nodes.size(); ++n)
+    {
+      const Node* node = nodes[n];
+      slices.push_back([&f, node](int i)
+                       {
+                         size_t size = node->rows.size();
+                         f(node->first_worker + i, *node,
+                           i * size / node->workers, (i + 1) * size / node->workers);
+                       });
+      node->pool->submit(node->workers, slices.back(), &pending[n]);
+    }
+
+    for(size_t n = 0; n < nodes.size(); ++n)
+      nodes[n]->pool->wait(&pending[n]);
+  }
+
+  // f(0) .. f(workers() - 1), each on its own worker
+  void run(const std::function<void(int)>& f) const
+  {
+    parallel_for([&f](int i, const Node&, size_t, size_t) { f(i); });
+  }
+
+ private:
+  NumaStore(const NumaStore&);
+  NumaStore& operator=(const NumaStore&);
+};
+
+}
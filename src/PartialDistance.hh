@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Example.hh"
+#include "TrainingSet.hh"
+#include "TopK.hh"
+
+namespace knn {
+
+// exact euclidean scan abandoning a row as soon as a lower bound of its
+// distance to the query exceeds the k-th best distance found so far:
+// - (|q| - |r|)^2 <= d(q, r) rejects a row from the norms alone
+// - with the query scattered in a dense array, the sum over the features
+//   of r walked so far of (q_f - r_f)^2 only grows along the row
+// the rows may be copied with their features by decreasing magnitude so
+// that the bound grows faster; the rows walked to the end are scored
+// with the usual kernel, the neighbours are those of the plain scan
+struct PartialDistanceScan
+{
+  const TrainingSet* training;
+  bool reordered;
+  unsigned dimension;
+  std::vector<unsigned> ids;
+  std::vector<double> values;
+  std::vector<double> norms;
+
+  PartialDistanceScan() : training(NULL), reordered(false), dimension(0), ids(), values(), norms() {};
+
+  void build(const TrainingSet& t, bool reorder)
+  {
+    training = &t;
+    reordered = reorder;
+
+    dimension = 0;
+    norms.clear();
+    ids.clear();
+    values.clear();
+    norms.reserve(t.size());
+    if(reorder)
+    {
+      ids.reserve(t.feature_ids.size());
+      values.reserve(t.values.size());
+    }
+    for(size_t r = 0; r < t.size(); ++r)
+      add(r);
+  }
+
+  // scan row r of the training set too, rows are added in order
+  void add(size_t r)
+  {
+    const TrainingSet& t = *training;
+    for(size_t j = t.row_begin(r); j < t.row_end(r); ++j)
+      dimension = std::max(dimension, t.feature_ids[j] + 1);
+    norms.push_back(std::sqrt(t.squared_norms[r]));
+
+    if(!reordered)
+      return;
+
+    static thread_local std::vector<std::pair<double, unsigned> > row;
+    row.clear();
+    for(size_t j = t.row_begin(r); j < t.row_end(r); ++j)
+      row.push_back(std::make_pair(-std::fabs(t.values[j]), j));
+    std::sort(row.begin(), row.end());
+    for(const auto& f : row)
+    {
+      ids.push_back(t.feature_ids[f.second]);
+      values.push_back(t.values[f.second]);
+    }
+  }
+
+  void scan(const Query& query, size_t begin, size_t end, TopK* topk) const
+  {
+    static thread_local std::vector<double> dense;
+    unsigned size = dimension;
+    for(const auto& id : query.ids)
+      size = std::max(size, id + 1);
+    if(dense.size() < size)
+      dense.resize(size, 0);
+    for(size_t i = 0; i < query.ids.size(); ++i)
+      dense[query.ids[i]] = query.values[i];
+
+    SparseRow q = query.row();
+    double query_norm = std::sqrt(q.squared_norm);
+    const unsigned* row_ids = reordered ? ids.data() : training->feature_ids.data();
+    const double* row_values = reordered ? values.data() : training->values.data();
+
+    for(size_t r = begin; r < end; ++r)
+    {
+      // the bounds are computed differently from the kernel, the slack
+      // keeps rounding from abandoning a row that ties
+      double limit = topk->bound() + 1e-9 * (q.squared_norm + training->squared_norms[r]);
+
+      double difference = query_norm - norms[r];
+      if(difference * difference > limit)
+        continue;
+
+      double partial = 0;
+      size_t j = training->row_begin(r), row_end = training->row_end(r);
+      for(; j < row_end; ++j)
+      {
+        double x = dense[row_ids[j]] - row_values[j];
+        partial += x * x;
+        if(partial > limit)
+          break;
+      }
+      if(j < row_end)
+        continue;
+
+      topk->push(kernels::euclidean(q, training->row(r)), r);
+    }
+
+    for(const auto& id : query.ids)
+      dense[id] = 0;
+  }
+};
+
+}
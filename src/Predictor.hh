@@ -5,83 +5,210 @@
 #include <unordered_map>
 
 #include <queue>
+#include <map>
+#include <limits>
 
 #include "Example.hh"
+#include "TrainingSet.hh"
+#include "ModelFile.hh"
+#include "Message.hh"
+#include "InvertedIndex.hh"
+#include "LshIndex.hh"
+#include "HnswIndex.hh"
+#include "IvfIndex.hh"
+#include "VpTree.hh"
+#include "CompactStore.hh"
+#include "PartialDistance.hh"
+#include "KnnGraph.hh"
+#include "ThreadPool.hh"
+#include "Numa.hh"
+#include "TopK.hh"
 #include "ExampleMaker.hh"
 
 #include "utils.h"
 
-int processed_lines = 0;
-int finished = 0;
-threadns::mutex mutex_processed_lines;
-threadns::mutex mutex_examples;
-threadns::condition_variable cond_process;
+// batch queries are scored by tiles: a block of training rows of about
+// TRAINING_BLOCK_BYTES stays in cache while every query of the batch
+// is compared against it
+#define TRAINING_BLOCK_BYTES (1 << 18)
 
-namespace knn {
-enum distance_type {EUCLIDEAN, COSINE};
+// the knn graph joins two tiles of about KNN_GRAPH_TILE_BYTES at a time
+#define KNN_GRAPH_TILE_BYTES (1 << 17)
 
+#define LSH_TABLES 32
+#define LSH_BITS 8
+#define LSH_PROBES 8
 
-struct file_reader
-{
-  char * buffer;
-  size_t buffer_size;
+#define HNSW_M 16
+#define EF_CONSTRUCTION 100
+#define EF_SEARCH 50
 
-  file_reader() : buffer(NULL), buffer_size(0) {}
+#define IVF_LISTS 0  // the square root of the number of rows
+#define NPROBE 8
+#define IVF_ITERATIONS 10
+#define IVF_CENTROID_FEATURES 1024  // weights kept per ivf centroid
 
-  ~file_reader() {free(buffer);}
+// with rescoring, a reduced precision scan keeps RESCORE_FACTOR * k
+// candidates, ranked again on the exact values
+#define RESCORE_FACTOR 4
 
-  void
-  process_file(FILE** fp, std::vector<char*>* lines)
-  {
-    while(0 < read_line(&buffer, &buffer_size, *fp))  {
-      if(buffer[0] != '\n') {
+// the training set is normalised again and its indices rebuilt once the
+// examples inserted or removed since the last build exceed that share of it
+#define REFRESH_FRACTION 0.1
 
-        mutex_processed_lines.lock();
-        lines->push_back(strdup(buffer));
-        cond_process.notify_all();
-        //        fprintf(stderr, "after notify, size lines: %ld\n", lines->size());
-        mutex_processed_lines.unlock();
-      }
-      else break;
+namespace knn {
+enum distance_type {EUCLIDEAN, COSINE};
+enum index_type {BRUTE_FORCE, INVERTED, LSH, HNSW, IVF, VP_TREE};
 
-    }
-    finished = 1;
-    cond_process.notify_all();
-  }
+// parameters of the indices and of the scan
+struct SearchOptions
+{
+  precision_type precision;
+  bool rescore;
+  bool early_stop;
+  bool reorder_features;
+  unsigned lsh_tables;
+  unsigned lsh_bits;
+  unsigned lsh_probes;
+  unsigned hnsw_m;
+  unsigned ef_construction;
+  unsigned ef_search;
+  unsigned ivf_lists;
+  unsigned nprobe;
+  bool numa;  // the exact scan split between the numa nodes, see NumaStore
+
+  SearchOptions() : precision(FLOAT64), rescore(false), early_stop(false), reorder_features(false),
+                    lsh_tables(LSH_TABLES), lsh_bits(LSH_BITS), lsh_probes(LSH_PROBES),
+                    hnsw_m(HNSW_M), ef_construction(EF_CONSTRUCTION), ef_search(EF_SEARCH),
+                    ivf_lists(IVF_LISTS), nprobe(NPROBE), numa(false) {};
 };
 
 
+// scales each feature to [0, 1] by its smallest and largest values
+// the bounds are widened as examples are added; removing an example
+// leaves them, they remain bounds of the values
+// normalise uses the bounds of the last apply, see ZNormaliser
 struct MaxMinNormaliser
 {
   std::vector<double> mins;
   std::vector<double> maxs;
 
-  MaxMinNormaliser() : mins(), maxs() {};
+  // running bounds
+  std::vector<double> running_mins;
+  std::vector<double> running_maxs;
+
+  MaxMinNormaliser() : mins(), maxs(), running_mins(), running_maxs() {};
+
+  static const char* name() { return "maxmin"; }
+
+  void write(ModelWriter* w) const
+  {
+    w->write_vector(mins);
+    w->write_vector(maxs);
+  }
+
+  void read(MappedFile* m)
+  {
+    m->read_vector(&mins);
+    m->read_vector(&maxs);
+  }
+
+  // the running bounds, passed from shard to shard
+  void write_running(Message* m) const
+  {
+    m->write_vector(running_mins);
+    m->write_vector(running_maxs);
+  }
 
-  void init(std::vector<Example*> training_examples)
+  void read_running(Message* m)
   {
-    for(const auto& e: training_examples)
+    m->read_vector(&running_mins);
+    m->read_vector(&running_maxs);
+  }
+
+  void init(const TrainingSet& training)
+  {
+    fit(training, false);
+    apply();
+  }
+
+  // the running bounds of the rows of training, whose values are
+  // normalised by the current bounds if normalised is set
+  void fit(const TrainingSet& training, bool normalised)
+  {
+    running_mins.clear();
+    running_maxs.clear();
+    for(size_t i = 0; i < training.feature_ids.size(); ++i)
     {
-      for(const auto& f : e->features)
-      {
-        if(mins.size() <= f.id)
-          mins.resize(f.id+1, std::numeric_limits<double>::infinity());
-        if(maxs.size() <= f.id)
-          maxs.resize(f.id+1, - std::numeric_limits<double>::infinity());
-
-        if(f.value < mins[f.id])
-          mins[f.id] = f.value;
-        if(f.value > maxs[f.id])
-          maxs[f.id] = f.value;
-      }
+      unsigned id = training.feature_ids[i];
+      add(id, normalised ? denormalise(id, training.values[i]) : training.values[i]);
     }
   }
 
+  void add(unsigned id, double value)
+  {
+    if(running_mins.size() <= id)
+      running_mins.resize(id+1, std::numeric_limits<double>::infinity());
+    if(running_maxs.size() <= id)
+      running_maxs.resize(id+1, - std::numeric_limits<double>::infinity());
+
+    if(value < running_mins[id])
+      running_mins[id] = value;
+    if(value > running_maxs[id])
+      running_maxs[id] = value;
+  }
+
+  void add(const SparseRow& row)
+  {
+    for(size_t j = 0; j < row.size; ++j)
+      add(row.ids[j], row.values[j]);
+  }
+
+  void remove(const SparseRow&) {}
+
+  // normalise with the running bounds
+  void apply()
+  {
+    mins = running_mins;
+    maxs = running_maxs;
+  }
+
+  // same for the features without bounds yet only
+  void apply_new()
+  {
+    mins.insert(mins.end(), running_mins.begin() + std::min(mins.size(), running_mins.size()), running_mins.end());
+    maxs.insert(maxs.end(), running_maxs.begin() + std::min(maxs.size(), running_maxs.size()), running_maxs.end());
+  }
+
+  // a feature unknown to the bounds is left as it is
+  inline double normalise(unsigned id, double value) const
+  {
+    if(id >= mins.size())
+      return value;
+    return (value - this->mins[id]) / (this->maxs[id] - this->mins[id]);
+  }
+
+  inline double denormalise(unsigned id, double value) const
+  {
+    if(id >= mins.size())
+      return value;
+    return value * (this->maxs[id] - this->mins[id]) + this->mins[id];
+  }
+
   void normalise(Example* e) const
   {
     for(auto& f : e->features)
     {
-      f.value = (f.value - this->mins[f.id]) / (this->maxs[f.id] - this->mins[f.id]);
+      f.value = normalise(f.id, f.value);
+    }
+  }
+
+  void normalise(TrainingSet* training) const
+  {
+    double* values = training->values.mutable_data();
+    for(size_t i = 0; i < training->values.size(); ++i)
+    {
+      values[i] = normalise(training->feature_ids[i], values[i]);
     }
   }
 
@@ -89,52 +216,181 @@ struct MaxMinNormaliser
 };
 
 
+// z-score of each feature, a feature absent from an example counting as
+// a zero value: means and (sample) deviations are over all the examples
+// running statistics follow the examples added and removed: for each
+// feature, the number of examples having it, the mean of their values
+// and the sum of their squared differences to it (Welford's updates),
+// combined with the zeros of the other examples when applied
+// normalise uses the statistics of the last apply, so that the training
+// values normalised then and the queries normalised since agree
 struct ZNormaliser
 {
   std::vector<double> means;
   std::vector<double> deviations;
 
-  ZNormaliser() : means(), deviations() {};
+  // running statistics
+  size_t rows;
+  std::vector<size_t> counts;
+  std::vector<double> feature_means;
+  std::vector<double> squares;
+
+  ZNormaliser() : means(), deviations(), rows(0), counts(), feature_means(), squares() {};
+
+  static const char* name() { return "z"; }
 
-  void init(std::vector<Example*> training_examples)
+  void write(ModelWriter* w) const
   {
-    for(const auto& e: training_examples)
-    {
-      for(const auto& f : e->features)
-      {
-        if(means.size() <= f.id) means.resize(f.id+1, 0);
-        means[f.id] += f.value;
-      }
-    }
-    for (size_t i = 0; i < means.size(); ++i)
+    w->write_vector(means);
+    w->write_vector(deviations);
+  }
+
+  void read(MappedFile* m)
+  {
+    m->read_vector(&means);
+    m->read_vector(&deviations);
+  }
+
+  // the running statistics, passed from shard to shard
+  void write_running(Message* m) const
+  {
+    m->write_value<uint64_t>(rows);
+    m->write_vector(counts);
+    m->write_vector(feature_means);
+    m->write_vector(squares);
+  }
+
+  void read_running(Message* m)
+  {
+    rows = m->read_value<uint64_t>();
+    m->read_vector(&counts);
+    m->read_vector(&feature_means);
+    m->read_vector(&squares);
+  }
+
+  void init(const TrainingSet& training)
+  {
+    fit(training, false);
+    apply();
+  }
+
+  // the running statistics of the rows of training, whose values are
+  // normalised by the current statistics if normalised is set
+  void fit(const TrainingSet& training, bool normalised)
+  {
+    rows = training.size();
+    counts.clear();
+    feature_means.clear();
+    squares.clear();
+    for(size_t i = 0; i < training.feature_ids.size(); ++i)
     {
-      means[i] /= training_examples.size();
+      unsigned id = training.feature_ids[i];
+      add(id, normalised ? denormalise(id, training.values[i]) : training.values[i]);
     }
-    deviations.resize(means.size());
+  }
 
-    for(const auto& e: training_examples)
+  void add(unsigned id, double value)
+  {
+    if(counts.size() <= id)
     {
-      for(const auto& f : e->features)
-      {
-        deviations[f.id] = (f.value - means[f.id]) * (f.value - means[f.id]);
-      }
+      counts.resize(id+1, 0);
+      feature_means.resize(id+1, 0);
+      squares.resize(id+1, 0);
     }
 
-    for (size_t i = 0; i < deviations.size(); ++i)
+    double delta = value - feature_means[id];
+    feature_means[id] += delta / ++counts[id];
+    squares[id] += delta * (value - feature_means[id]);
+  }
+
+  void remove(unsigned id, double value)
+  {
+    if(id >= counts.size() || counts[id] == 0)
+      return;
+
+    if(--counts[id] == 0)
     {
-      deviations[i] = std::sqrt( deviations[i] / (deviations.size() - 1));
+      feature_means[id] = squares[id] = 0;
+      return;
     }
 
+    double delta = value - feature_means[id];
+    feature_means[id] -= delta / counts[id];
+    squares[id] = std::max(0.0, squares[id] - delta * (value - feature_means[id]));
+  }
 
+  void add(const SparseRow& row)
+  {
+    ++rows;
+    for(size_t j = 0; j < row.size; ++j)
+      add(row.ids[j], row.values[j]);
+  }
 
+  void remove(const SparseRow& row)
+  {
+    --rows;
+    for(size_t j = 0; j < row.size; ++j)
+      remove(row.ids[j], row.values[j]);
+  }
+
+  // normalise with the running statistics of feature id
+  void apply(unsigned id)
+  {
+    double n = rows, c = counts[id], mean = feature_means[id];
+    double variance = n > 1 ? (squares[id] + mean * mean * c * (n - c) / n) / (n - 1) : 0;
+
+    means[id] = n > 0 ? c * mean / n : 0;
+    // a constant feature is only centred
+    deviations[id] = variance > 0 ? std::sqrt(variance) : 1;
+  }
 
+  void apply()
+  {
+    means.assign(counts.size(), 0);
+    deviations.assign(counts.size(), 1);
+    for (size_t i = 0; i < counts.size(); ++i)
+      apply(i);
+  }
+
+  // same for the features without statistics yet only
+  void apply_new()
+  {
+    size_t first = means.size();
+    means.resize(std::max(first, counts.size()), 0);
+    deviations.resize(means.size(), 1);
+    for (size_t i = first; i < counts.size(); ++i)
+      apply(i);
+  }
+
+  // a feature unknown to the statistics is left as it is
+  inline double normalise(unsigned id, double value) const
+  {
+    if(id >= means.size())
+      return value;
+    return (value - this->means[id]) / this->deviations[id];
+  }
+
+  inline double denormalise(unsigned id, double value) const
+  {
+    if(id >= means.size())
+      return value;
+    return value * this->deviations[id] + this->means[id];
   }
 
   void normalise(Example* e) const
   {
     for(auto& f : e->features)
     {
-      f.value = (f.value - this->means[f.id]) / this->deviations[f.id];
+      f.value = normalise(f.id, f.value);
+    }
+  }
+
+  void normalise(TrainingSet* training) const
+  {
+    double* values = training->values.mutable_data();
+    for(size_t i = 0; i < training->values.size(); ++i)
+    {
+      values[i] = normalise(training->feature_ids[i], values[i]);
     }
   }
 
@@ -142,122 +398,963 @@ struct ZNormaliser
 };
 
 
+// training examples can be inserted and removed while queries run:
+// - an insertion is normalised, appended and added to the index in place
+// - a removal marks the rows with the example id, the searches skip them
+// - the normaliser statistics follow both, they are applied to the
+//   training set (and to the queries) when it is rebuilt, see refresh
+// updates hold update_mutex for writing; predict and load_query hold it
+// for reading, the other searches are left to callers not running
+// updates at the same time
 template<class Normaliser>
 struct Predictor {
 
   int num_threads;
-  std::vector<Example*> training_examples;
+  TrainingSet training;
   unsigned k;
   distance_type dt;
+  index_type it;
+  SearchOptions options;
   Normaliser normaliser;
+  InvertedIndex inverted_index;
+  LshIndex lsh_index;
+  HnswIndex hnsw_index;
+  IvfIndex ivf_index;
+  VpTree vp_tree;
+  CompactStore compact;
+  bool rescore;
+  PartialDistanceScan partial_scan;
+  bool early_stop;
+  mutable ThreadPool pool;
+  NumaStore numa;
+  MappedFile model;
+
+  std::vector<char> removed;  // by row, empty if no row is removed
+  size_t num_removed;
+  size_t updates;  // rows inserted or removed since the last build
+  bool fitted;     // whether the normaliser has running statistics
+  std::unordered_multimap<std::string, size_t> rows_by_id;  // live rows, built by the first removal
+  std::vector<unsigned> feature_rows;  // rows having each feature, only counted for the stats
+  mutable SharedMutex update_mutex;
+
+
+  // without training set, for a shard to load its own (see Shard.hh)
+  Predictor(int numthreads, unsigned K, distance_type DT, index_type IT, const SearchOptions& options) :
+      num_threads(numthreads), training(), k(K), dt(DT), it(IT), options(options),
+      normaliser(), inverted_index(), lsh_index(), hnsw_index(), ivf_index(), vp_tree(),
+      compact(), rescore(options.rescore && options.precision != FLOAT64),
+      partial_scan(), early_stop(options.early_stop && DT == EUCLIDEAN && options.precision == FLOAT64),
+      // the thread calling predict is the last worker, with numa the
+      // pinned workers do all the work
+      pool(options.numa ? 0 : numthreads - 1),
+      numa(), model(), removed(), num_removed(0), updates(0), fitted(false), rows_by_id(), feature_rows(),
+      update_mutex()
+  {
+    if(options.numa)
+      numa.init(numthreads);
+  }
+
+  // filename is a text training file, or a model saved by save_model if binary is set
+  Predictor(int numthreads, const std::string& filename, unsigned K, distance_type DT,
+            index_type IT = BRUTE_FORCE, bool binary = false,
+            const SearchOptions& options = SearchOptions()) :
+      Predictor(numthreads, K, DT, IT, options)
+  {
+    if(binary)
+    {
+      load_model(filename);
+    }
+    else
+    {
+      load_train(filename);
+      {
+        stats::Timer timer(stats::LOAD_NORMALISER_FIT);
+        normaliser.init(training);
+      }
+      normaliser.normalise(&training);
+      training.update_norms();
+      fitted = true;
+    }
 
+    build();
+  }
 
-  Predictor(int numthreads, const std::string& trainname, unsigned K, distance_type DT) :
-      num_threads(numthreads), training_examples(), k(K), dt(DT), normaliser()
+  // the structures searched besides the training set
+  void build()
   {
-    load_train(trainname);
-    normaliser.init(training_examples);
-    std::for_each(training_examples.begin(), training_examples.end(),
-                  [&](Example *e)
-                  {
-                    normaliser.normalise(e);
-                  }
-                  );
+    compact.build(training, options.precision);
+    if(early_stop)
+      partial_scan.build(training, options.reorder_features);
+
+    if(it == INVERTED)
+      inverted_index.build(training);
+    if(it == LSH)
+      lsh_index.build(training, options.lsh_tables, options.lsh_bits, options.lsh_probes, &pool, num_threads);
+    if(it == HNSW)
+      hnsw_index.build(training, distance_kernel(),
+                       options.hnsw_m, options.ef_construction, options.ef_search, &pool, num_threads);
+    if(it == IVF)
+      ivf_index.build(training, dt == COSINE, options.ivf_lists, options.nprobe, IVF_ITERATIONS, IVF_CENTROID_FEATURES,
+                      &pool, num_threads);
+    if(it == VP_TREE)
+      vp_tree.build(training, &pool);
+
+    feature_rows.clear();
+    if(stats::enabled)
+      for(const auto& f : training.feature_ids)
+        count_feature_row(f);
+
+    // the features move to the numa nodes, the statistics of a loaded
+    // model are taken before
+    if(options.numa)
+    {
+      fit();
+      numa.build(&training);
+    }
   }
 
+  void count_feature_row(unsigned f)
+  {
+    if(feature_rows.size() <= f)
+      feature_rows.resize(f + 1, 0);
+    ++feature_rows[f];
+  }
+
+  // the features a scan of every row intersects with query
+  size_t feature_pairs(const Query& query) const
+  {
+    size_t res = 0;
+    for(const auto& f : query.ids)
+      if(f < feature_rows.size())
+        res += feature_rows[f];
+    return res;
+  }
+
+  // f(0) .. f(num_threads - 1) on the pool, or with numa on the pinned workers
+  void parallel_for(const std::function<void(int)>& f) const
+  {
+    if(options.numa)
+      numa.run(f);
+    else
+      pool.parallel_for(num_threads, f);
+  }
+
+  // parse the training file mapped in memory, one chunk of lines per thread
   void load_train(const std::string& filename)
   {
-    FILE* fp = fopen(filename.c_str(), "r");
-    if(!fp) {
+    MappedFile file;
+    const char* end;
+    {
+      stats::Timer timer(stats::LOAD_READ);
+      if(!file.open(filename)) {
+        fprintf(stderr, "ERROR: cannot load model from \"%s\"\n", filename.c_str());
+        return;
+      }
+      madvise(file.address, file.length, MADV_SEQUENTIAL);
+      end = examples_end(file.address, file.address + file.length);
+    }
+
+    std::vector<ExampleMaker> makers = parse_examples(file.address, end);
+    std::vector<std::vector<unsigned> > global_ids = merge_dictionaries(makers);
+    add_examples(&makers, global_ids);
+  }
+
+  // the steps of load_train, a shard runs them on its part of the file
+  // with the dictionaries of the other shards merged in between
+
+  // parse the lines [begin, end) of a mapped file, one chunk per thread
+  std::vector<ExampleMaker> parse_examples(const char* begin, const char* end)
+  {
+    std::vector<const char*> bounds = split_lines(begin, end, num_threads);
+    std::vector<ExampleMaker> makers;
+    makers.reserve(num_threads);
+    for(int i = 0; i < num_threads; ++i)
+      makers.emplace_back(bounds[i], bounds[i + 1]);
+
+    // pages of the mapping are read in as they are parsed
+    parallel_for([&](int i)
+                 {
+                   stats::Timer timer(stats::LOAD_PARSE);
+                   makers[i].create_examples();
+                 }
+                 );
+    return makers;
+  }
+
+  // merged in file order, global ids are those a sequential parse would
+  // give; returns the global id of each local one, by chunk
+  std::vector<std::vector<unsigned> > merge_dictionaries(const std::vector<ExampleMaker>& makers)
+  {
+    stats::Timer timer(stats::LOAD_DICTIONARY);
+    std::vector<std::vector<unsigned> > global_ids;
+    for(const auto& m : makers)
+      global_ids.push_back(m.dictionary.merge());
+    return global_ids;
+  }
+
+  // the parsed examples with their global feature ids and without noise,
+  // appended to the training set
+  void add_examples(std::vector<ExampleMaker>* chunks, const std::vector<std::vector<unsigned> >& global_ids)
+  {
+    std::vector<ExampleMaker>& makers = *chunks;
+
+    // the feature counts are complete once every chunk is merged
+    parallel_for([&](int i)
+                 {
+                   makers[i].examples.remap_features(global_ids[i]);
+                   stats::Timer timer(stats::LOAD_NOISE);
+                   makers[i].examples.remove_noise(0.0001);
+                   makers[i].dictionary = LocalDictionary();
+                 }
+                 );
+
+    size_t num_examples = 0, num_features = 0;
+    for(const auto& m : makers)
+    {
+      num_examples += m.examples.size();
+      num_features += m.examples.feature_ids.size();
+    }
+
+    training.reserve(num_examples, num_features);
+    for(auto& m : makers)
+    {
+      training.append(m.examples);
+      m.examples = TrainingSet();
+    }
+
+    fprintf(stderr, "%lu examples read\n", training.size());
+  }
+
+  // write the normalised training set, the feature dictionary and the
+  // normaliser statistics to a binary model file
+  bool save_model(const std::string& filename) const
+  {
+    if(num_removed)
+    {
+      fprintf(stderr, "ERROR: cannot save a model with removed examples before a refresh\n");
+      return false;
+    }
+
+    ModelWriter w(filename);
+
+    ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.size_of_size_t = sizeof(size_t);
+    strncpy(header.normaliser, Normaliser::name(), sizeof(header.normaliser) - 1);
+    header.rows = training.size();
+    header.features = training.feature_ids.size();
+    header.dictionary = counter;
+    header.categories = training.category_names.size();
+    header.count_total = count_map_counter;
+    w.write(&header, sizeof(header));
+
+    w.write_array(training.offsets);
+    w.write_array(training.feature_ids);
+    w.write_array(training.values);
+    w.write_array(training.squared_norms);
+    w.write_array(training.categories);
+    w.write_strings(training.ids);
+    w.write_strings(training.category_names);
+
+    StringTable dictionary;
+    std::vector<std::string> names(counter);
+    for(const auto& f : string_map)
+      names[f.second] = f.first;
+    for(const auto& n : names)
+      dictionary.push_back(n);
+    w.write_strings(dictionary);
+
+    Array<double> counts;
+    counts.assign(counter, 0);
+    for(const auto& c : count_map)
+      if(c.first >= 0 && c.first < counter)
+        counts.mutable_data()[c.first] = c.second;
+    w.write_array(counts);
+
+    normaliser.write(&w);
+
+    if(!w.close())
+    {
+      fprintf(stderr, "ERROR: cannot save model to \"%s\"\n", filename.c_str());
+      return false;
+    }
+    fprintf(stderr, "model saved to %s\n", filename.c_str());
+    return true;
+  }
+
+  // write the k nearest other training rows of each training row to a
+  // text file, one 'id neighbour_id distance' line per neighbour, nearest
+  // first; the distances are those the search ranks by (squared for euclidean)
+  bool write_knn_graph(const std::string& filename) const
+  {
+    FILE* fp = fopen(filename.c_str(), "w");
+    if(!fp)
+    {
+      fprintf(stderr, "ERROR: cannot write knn graph to \"%s\"\n", filename.c_str());
+      return false;
+    }
+
+    // the lists of a tile are written as soon as it is complete
+    KnnGraph graph;
+    graph.build(training, k, distance_kernel(), KNN_GRAPH_TILE_BYTES, &pool, num_threads,
+                [&](size_t r, const std::vector<Neighbour>& neighbours)
+                {
+                  for(const auto& n : neighbours)
+                    fprintf(fp, "%s %s %.17g\n", training.ids[r], training.ids[n.index], n.distance);
+                }
+                );
+
+    if(ferror(fp) | fclose(fp))
+    {
+      fprintf(stderr, "ERROR: cannot write knn graph to \"%s\"\n", filename.c_str());
+      return false;
+    }
+    fprintf(stderr, "knn graph written to %s\n", filename.c_str());
+    return true;
+  }
+
+  // map a model written by save_model, the training set is used in place
+  void load_model(const std::string& filename)
+  {
+    if(!model.open(filename)) {
       fprintf(stderr, "ERROR: cannot load model from \"%s\"\n", filename.c_str());
       return;
     }
 
+    const ModelHeader* header = (const ModelHeader*) model.read(sizeof(ModelHeader));
+    if(!header || memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != MODEL_VERSION || header->size_of_size_t != sizeof(size_t) ||
+       strncmp(header->normaliser, Normaliser::name(), sizeof(header->normaliser)) != 0) {
+      fprintf(stderr, "ERROR: \"%s\" is not a compatible model file\n", filename.c_str());
+      return;
+    }
+
+    model.read_array(&training.offsets, header->rows + 1);
+    model.read_array(&training.feature_ids, header->features);
+    model.read_array(&training.values, header->features);
+    model.read_array(&training.squared_norms, header->rows);
+    model.read_array(&training.categories, header->rows);
+    model.read_strings(&training.ids, header->rows);
+    model.read_strings(&training.category_names, header->categories);
 
-    file_reader fr;
+    StringTable dictionary;
+    model.read_strings(&dictionary, header->dictionary);
+    Array<double> counts;
+    model.read_array(&counts, header->dictionary);
 
-    std::vector<char*> lines;
-    std::vector<knn::ExampleMaker*> exampleMakers(num_threads, NULL);
+    normaliser.read(&model);
 
-    for(int i = 0; i < num_threads; ++i) {
-      exampleMakers[i] = new knn::ExampleMaker(lines, training_examples);
+    if(!model.ok) {
+      fprintf(stderr, "ERROR: model file \"%s\" is truncated\n", filename.c_str());
+      training = TrainingSet();
+      return;
     }
 
-    processed_lines = 0;
-    finished = 0;
+    string_map.clear();
+    count_map.clear();
+    for(size_t i = 0; i < header->dictionary; ++i)
+    {
+      string_map[dictionary[i]] = i;
+      count_map[i] = counts[i];
+    }
+    counter = header->dictionary;
+    count_map_counter = header->count_total;
+
+    fprintf(stderr, "%lu examples mapped from %s\n", training.size(), filename.c_str());
+  }
+
+  kernels::distance_function distance_kernel() const
+  {
+    return dt == EUCLIDEAN ? kernels::euclidean : kernels::cosine;
+  }
 
-    threadns::thread thread_read(&file_reader::process_file, &fr, &fp, &lines);
+  // row r of the training set, with numa from the node holding it
+  SparseRow row(size_t r) const
+  {
+    return options.numa ? numa.row(r) : training.row(r);
+  }
 
-    for(int i = 0; i < num_threads; ++i) {
-      exampleMakers[i]->start(&mutex_processed_lines, &processed_lines, &finished, &cond_process, &mutex_examples);
+  inline double distance(const Query& query, size_t r) const
+  {
+    return distance(query, row(r));
+  }
+
+  inline double distance(const Query& query, const SparseRow& row) const
+  {
+    return (dt == EUCLIDEAN) ?
+        kernels::euclidean(query.row(), row) :
+        kernels::cosine(query.row(), row);
+  }
+
+  // prepared is query as returned by compact.prepare
+  void scan(const Query& query, const Query& prepared, size_t begin, size_t end, TopK* topk) const
+  {
+    switch(compact.precision)
+    {
+      case FLOAT64:
+        if(early_stop)
+        {
+          partial_scan.scan(query, begin, end, topk);
+          break;
+        }
+        for(size_t i = begin; i < end; ++i)
+        {
+          topk->push(distance(query, i), i);
+        }
+        break;
+      case FLOAT32:
+        scan_compact(prepared.row(), compact.values32, begin, end, topk);
+        break;
+      case INT8:
+        scan_compact(prepared.row(), compact.values8, begin, end, topk);
+        break;
     }
+  }
+
+  // the rows [begin, end) of the part of a numa node, at double precision
+  void scan_part(const Query& query, const NumaStore::Node& node, size_t begin, size_t end, TopK* topk) const
+  {
+    for(size_t i = begin; i < end; ++i)
+      topk->push(distance(query, node.rows.row(i)), node.begin + i);
+  }
+
+  template<class T>
+  void scan_compact(const SparseRow& q, const std::vector<T>& values, size_t begin, size_t end,
+                    TopK* topk) const
+  {
+    if(dt == EUCLIDEAN)
+      for(size_t i = begin; i < end; ++i)
+        topk->push(kernels::euclidean_compact(q, compact.row(i, values)), i);
+    else
+      for(size_t i = begin; i < end; ++i)
+        topk->push(kernels::cosine_compact(q, compact.row(i, values)), i);
+  }
 
-    thread_read.join();
+  // a heap of the nearest rows, the removed ones left out
+  TopK heap(unsigned size) const
+  {
+    return TopK(size, removed.empty() ? NULL : removed.data());
+  }
 
-    for(auto i = exampleMakers.begin(); i != exampleMakers.end(); ++i)
-      (*i)->join();
+  // the number of rows a scan keeps per query
+  unsigned candidates() const
+  {
+    return rescore ? k * RESCORE_FACTOR : k;
+  }
 
-    fprintf(stderr, "%lu examples read\n", training_examples.size());
+  // the k nearest of the candidates kept by a reduced precision scan,
+  // on their exact distances
+  std::vector<Neighbour> rescored(const Query& query, const std::vector<Neighbour>& candidates) const
+  {
+    if(!rescore)
+      return candidates;
 
-    for(auto& e : training_examples)
+    TopK topk(k);
+    for(const auto& c : candidates)
+      topk.push(distance(query, c.index), c.index);
+    return topk.sorted();
+  }
+
+  // the k nearest training rows of example, nearest first
+  // (approximate with the lsh, hnsw and ivf indices)
+  std::vector<Neighbour> neighbours(const Example& example) const
+  {
+    if(it == BRUTE_FORCE)
+      return exact_neighbours(example);
+
+    if(it == IVF)
     {
-      e->remove_noise(0.0001);
+      // the probed lists are shared among the workers
+      Query query(example);
+      std::vector<unsigned> probes = ivf_index.probe(query);
+      std::vector<TopK> heaps(num_threads, heap(k));
+
+      {
+        stats::Timer timer(stats::QUERY_SCAN);
+        pool.parallel_for(num_threads,
+                          [&](int i)
+                          {
+                            for(size_t p = i; p < probes.size(); p += num_threads)
+                              ivf_index.scan(query, probes[p], distance_kernel(), &heaps[i]);
+                          }
+                          );
+      }
+
+      stats::Timer timer(stats::QUERY_SELECT);
+      return merge(heaps, k);
     }
 
-    fclose(fp);
+    return index_neighbours(example);
   }
 
-  std::string predict(Example& example) {
+  // the neighbours of example found by the index, on the calling thread
+  std::vector<Neighbour> index_neighbours(const Example& example) const
+  {
+    TopK topk = heap(k);
+    stats::Timer timer(stats::QUERY_SCAN);
+
+    switch(it)
+    {
+      case INVERTED:
+        inverted_index.search(example, &topk);
+        break;
+      case LSH:
+        lsh_index.search(Query(example), &topk);
+        break;
+      case HNSW:
+        hnsw_index.search(Query(example), &topk);
+        break;
+      case IVF:
+        ivf_index.search(Query(example), distance_kernel(), &topk);
+        break;
+      case VP_TREE:
+        vp_tree.search(Query(example), &topk);
+        break;
+      case BRUTE_FORCE:
+        return exact_neighbours(example);
+    }
 
-    std::priority_queue<Example> queue;
+    timer.stop();
+    stats::Timer select_timer(stats::QUERY_SELECT);
+    return topk.sorted();
+  }
 
-    threadns::thread tab[num_threads];
+  // the k nearest training rows of example by a scan of the whole training set
+  std::vector<Neighbour> exact_neighbours(const Example& example) const
+  {
+    Query query(example);
+    Query prepared = compact.prepare(query);
+    std::vector<TopK> heaps(num_threads, heap(candidates()));
 
-    for(int i = 0; i < num_threads; ++i) {
-      tab[i] = threadns::thread((dt == EUCLIDEAN) ?
-                                &Example::compute_distances :
-                                &Example::compute_similarities,
-                                &example,
-                                training_examples,
-                                i * training_examples.size() / num_threads,
-                                (i+1)* training_examples.size() / num_threads);
+    if(options.numa)
+    {
+      stats::Timer timer(stats::QUERY_SCAN);
+      numa.parallel_for([&](int i, const NumaStore::Node& node, size_t begin, size_t end)
+                        {
+                          scan_part(query, node, begin, end, &heaps[i]);
+                        }
+                        );
     }
+    else
+    {
+      stats::Timer timer(stats::QUERY_SCAN);
+      pool.parallel_for(num_threads,
+                        [&](int i)
+                        {
+                          scan(query, prepared,
+                               i * training.size() / num_threads,
+                               (i+1) * training.size() / num_threads,
+                               &heaps[i]);
+                        }
+                        );
+    }
+    stats::count(stats::EXAMPLES_SCANNED, training.size());
+    if(stats::enabled)
+      stats::count(stats::FEATURE_PAIRS, feature_pairs(query));
 
-    for(int i = 0; i < num_threads; ++i)
+    stats::Timer timer(stats::QUERY_SELECT);
+    return rescored(query, merge(heaps, candidates()));
+  }
+
+  // the k nearest training rows of each query, nearest first
+  std::vector<std::vector<Neighbour> > neighbours(const std::vector<Example>& queries) const
+  {
+    std::vector<std::vector<Neighbour> > res(queries.size());
+
+    if(queries.size() == 1)
     {
-      tab[i].join();
+      res[0] = neighbours(queries[0]);
+      return res;
     }
 
-    // get the k nearest neighbours
-    for (auto& e : training_examples)
+    // an index search is sequential, queries are spread over the workers
+    if(it != BRUTE_FORCE)
     {
-      if(queue.empty() || e->distance < queue.top().distance)
-        queue.push(*e);
+      pool.parallel_for(num_threads,
+                        [&](int i)
+                        {
+                          for(size_t q = i * queries.size() / num_threads;
+                              q < (i+1) * queries.size() / num_threads; ++q)
+                            res[q] = index_neighbours(queries[q]);
+                        }
+                        );
+      return res;
+    }
+
+    return exact_neighbours(queries);
+  }
 
-      if(queue.size() > this->k)
-        queue.pop();
+  // the end of the block of rows from begin (before end) of about
+  // TRAINING_BLOCK_BYTES, with values of value_bytes
+  static size_t block_end(const TrainingSet& rows, size_t begin, size_t end, size_t value_bytes)
+  {
+    size_t bytes = 0;
+    while(begin < end && bytes < TRAINING_BLOCK_BYTES)
+    {
+      bytes += (rows.row_end(begin) - rows.row_begin(begin)) * (sizeof(unsigned) + value_bytes);
+      ++begin;
     }
+    return begin;
+  }
+
+  // the k nearest training rows of each query by a scan of the whole training set
+  std::vector<std::vector<Neighbour> > exact_neighbours(const std::vector<Example>& queries) const
+  {
+    std::vector<std::vector<Neighbour> > res(queries.size());
 
-    std::unordered_map<std::string,int> counts;
-    while(!queue.empty())
+    if(queries.size() == 1)
     {
-      // fprintf(stdout, "size: %lu\tcategory: %s\tdistance: %f\n", queue.size(), queue.top().category.c_str(), queue.top().distance);
-      counts[queue.top().category] += 1;
-      queue.pop();
+      res[0] = exact_neighbours(queries[0]);
+      return res;
     }
 
-    std::string res = "";
-    int max = 0;
+    std::vector<Query> packed(queries.begin(), queries.end());
+    std::vector<Query> prepared;
+    prepared.reserve(packed.size());
+    for(const auto& q : packed)
+      prepared.push_back(compact.prepare(q));
+    size_t value_bytes = compact.precision == FLOAT32 ? sizeof(float) :
+        compact.precision == INT8 ? sizeof(int8_t) : sizeof(double);
+
+    // heaps[q][i] holds the neighbours of query q found by worker i
+    std::vector<std::vector<TopK> > heaps(queries.size(),
+                                          std::vector<TopK>(num_threads, heap(candidates())));
+
+    stats::Timer scan_timer(stats::QUERY_SCAN);
+    if(options.numa)
+      numa.parallel_for([&](int i, const NumaStore::Node& node, size_t begin, size_t end)
+                        {
+                          while(begin < end)
+                          {
+                            size_t next = block_end(node.rows, begin, end, value_bytes);
+                            for(size_t q = 0; q < queries.size(); ++q)
+                              scan_part(packed[q], node, begin, next, &heaps[q][i]);
+                            begin = next;
+                          }
+                        }
+                        );
+    else
+      pool.parallel_for(num_threads,
+                        [&](int i)
+                        {
+                          size_t begin = i * training.size() / num_threads;
+                          size_t end = (i+1) * training.size() / num_threads;
+
+                          while(begin < end)
+                          {
+                            size_t next = block_end(training, begin, end, value_bytes);
+                            for(size_t q = 0; q < queries.size(); ++q)
+                              scan(packed[q], prepared[q], begin, next, &heaps[q][i]);
+                            begin = next;
+                          }
+                        }
+                        );
+
+    scan_timer.stop();
+    stats::count(stats::EXAMPLES_SCANNED, queries.size() * training.size());
+    if(stats::enabled)
+      for(const auto& q : packed)
+        stats::count(stats::FEATURE_PAIRS, feature_pairs(q));
+
+    stats::Timer select_timer(stats::QUERY_SELECT);
+    for(size_t q = 0; q < queries.size(); ++q)
+      res[q] = rescored(packed[q], merge(heaps[q], candidates()));
+
+    return res;
+  }
+
+  // read a query from the characters [begin, end) of an input line, with
+  // the noise removal and normalisation of the training examples
+  void load_query(const char* begin, const char* end, Example* example) const
+  {
+    read_lock_type lock(update_mutex);
+    {
+      stats::Timer timer(stats::QUERY_PARSE);
+      example->load(begin, end, true, false);
+    }
+    stats::Timer timer(stats::QUERY_NORMALISE);
+    example->remove_noise(0.0001);
+    normaliser.normalise(example);
+  }
 
-    for(auto& i : counts)
+  // row r as a query, with its normalised values
+  Example example(size_t r) const
+  {
+    Example e;
+    e.id = training.ids[r];
+    e.category = training.category(r);
+    SparseRow features = row(r);
+    for(size_t j = 0; j < features.size; ++j)
+      e.features.emplace_back(features.ids[j], features.values[j]);
+    return e;
+  }
+
+  // row r as an example, with its values before normalisation
+  Example raw_example(size_t r) const
+  {
+    Example e;
+    e.id = training.ids[r];
+    e.category = training.category(r);
+    SparseRow features = row(r);
+    for(size_t j = 0; j < features.size; ++j)
+      e.features.emplace_back(features.ids[j], normaliser.denormalise(features.ids[j], features.values[j]));
+    return e;
+  }
+
+  // the running statistics of a loaded model are those of its rows
+  void fit()
+  {
+    if(!fitted)
+      normaliser.fit(training, true);
+    fitted = true;
+  }
+
+  // why the example of an input line cannot be inserted, empty if it can:
+  // it needs an id, a category and a feature of nonzero value
+  static std::string invalid_example(const char* begin, const char* end)
+  {
+    // parsed with a dictionary of its own, the global one is left untouched
+    LocalDictionary dictionary;
+    Example e;
+    e.load(begin, end, false, true, &dictionary);
+
+    if(e.id.empty())
+      return "the example has no id";
+    if(e.category.empty())
+      return "the example has no category";
+    for(const auto& f : e.features)
+      if(f.value != 0)
+        return "";
+    return "the example has no features";
+  }
+
+  // add the example of a valid input line to the training set, returns its
+  // id, or an empty id and nothing inserted if every feature is noise (the
+  // features stay counted in the dictionary)
+  std::string insert(const char* begin, const char* end)
+  {
+    write_lock_type lock(update_mutex);
+    fit();
+
+    Example e;
+    e.load(begin, end, true, true);
+    e.remove_noise(0.0001);
+    if(e.features.empty())
+      return std::string();
+    normaliser.add(Query(e).row());
+    normaliser.apply_new();
+    normaliser.normalise(&e);
+
+    size_t r = training.size();
+    training.add(e, !options.numa);
+    if(options.numa)
+      numa.add(e);
+    if(stats::enabled)
+      for(const auto& f : e.features)
+        count_feature_row(f.id);
+    if(!removed.empty())
+      removed.push_back(0);
+    if(!rows_by_id.empty())
+      rows_by_id.insert(std::make_pair(e.id, r));
+
+    compact.add(r);
+    if(early_stop)
+      partial_scan.add(r);
+
+    switch(it)
     {
-      if(i.second > max)
+      case INVERTED:
+        inverted_index.add(training, r);
+        break;
+      case LSH:
+        lsh_index.add(r);
+        break;
+      case HNSW:
+        hnsw_index.add(r);
+        break;
+      case IVF:
+        ivf_index.add(r);
+        break;
+      case VP_TREE:
+        vp_tree.add(r);
+        break;
+      case BRUTE_FORCE:
+        break;
+    }
+
+    ++updates;
+    if(updates > REFRESH_FRACTION * training.size())
+      rebuild();
+
+    return e.id;
+  }
+
+  // remove the training examples with that id, returns their number
+  size_t remove(const std::string& id)
+  {
+    write_lock_type lock(update_mutex);
+    fit();
+
+    if(rows_by_id.empty())
+      for(size_t r = 0; r < training.size(); ++r)
+        if(removed.empty() || !removed[r])
+          rows_by_id.insert(std::make_pair(std::string(training.ids[r]), r));
+
+    auto range = rows_by_id.equal_range(id);
+    size_t res = 0;
+    for(auto i = range.first; i != range.second; ++i, ++res)
+    {
+      if(removed.empty())
+        removed.assign(training.size(), 0);
+      removed[i->second] = 1;
+      normaliser.remove(Query(raw_example(i->second)).row());
+    }
+    rows_by_id.erase(range.first, range.second);
+
+    num_removed += res;
+    updates += res;
+    if(res && updates > REFRESH_FRACTION * training.size())
+      rebuild();
+
+    return res;
+  }
+
+  // normalise the training set again with the running statistics and
+  // rebuild it without the removed rows, queries wait meanwhile
+  void refresh()
+  {
+    write_lock_type lock(update_mutex);
+    fit();
+    rebuild();
+  }
+
+  void rebuild()
+  {
+    TrainingSet live;
+    live.reserve(training.size() - num_removed, training.feature_ids.size());
+    for(size_t r = 0; r < training.size(); ++r)
+      if(removed.empty() || !removed[r])
+        live.add(raw_example(r));
+
+    normaliser.apply();
+    normaliser.normalise(&live);
+    live.update_norms();
+    std::swap(training, live);
+
+    removed.clear();
+    num_removed = 0;
+    updates = 0;
+    rows_by_id.clear();
+
+    build();
+    fprintf(stderr, "training set rebuilt: %lu examples\n", training.size());
+  }
+
+  // whether an input line is an update rather than a query:
+  // '+ <example>' inserts the example, '- <id>' removes the examples with that id
+  static bool is_update(const char* begin, const char* end)
+  {
+    return begin < end && (*begin == '+' || *begin == '-') &&
+        (begin + 1 == end || Example::next_separator(begin + 1, end) == begin + 1);
+  }
+
+  // carry out an update line, reply is set to '+ <id>',
+  // '- <id> <examples removed>' or '! <reason>' for a line left undone
+  void update(const char* begin, const char* end, std::string* reply)
+  {
+    const char* rest = std::min(begin + 2, end);
+    if(*begin == '+')
+    {
+      std::string error = invalid_example(rest, end);
+      std::string id;
+      if(error.empty() && (id = insert(rest, end)).empty())
+        error = "every feature of the example is noise";
+      *reply = error.empty() ? "+ " + id : "! " + error;
+      return;
+    }
+
+    std::string id(rest, Example::next_separator(rest, end));
+    if(id.empty())
+    {
+      *reply = "! the removal has no id";
+      return;
+    }
+    size_t n = remove(id);
+    *reply = "- " + id + " " + std::to_string(n);
+  }
+
+  std::string predict(const Example& example) const
+  {
+    read_lock_type lock(update_mutex);
+    return vote(neighbours(example));
+  }
+
+  // predictions for a batch of queries, in input order
+  std::vector<std::string> predict(const std::vector<Example>& queries) const
+  {
+    read_lock_type lock(update_mutex);
+    std::vector<std::vector<Neighbour> > n = neighbours(queries);
+
+    std::vector<std::string> res;
+    res.reserve(queries.size());
+    for(const auto& l : n)
+      res.push_back(vote(l));
+
+    return res;
+  }
+
+  // the votes among the first 1, 2 ... n neighbours, from a single list
+  // of the n nearest: res[i] is the prediction with k = i + 1
+  std::vector<std::string> sweep_votes(const std::vector<Neighbour>& neighbours) const
+  {
+    static thread_local std::vector<int> counts;
+    counts.resize(training.category_names.size(), 0);
+
+    std::vector<std::string> res;
+    res.reserve(neighbours.size());
+    int max = 0;
+    for(size_t i = 0; i < neighbours.size(); ++i)
+    {
+      max = std::max(max, ++counts[training.categories[neighbours[i].index]]);
+      for(size_t j = 0; j <= i; ++j)
+        if(counts[training.categories[neighbours[j].index]] == max)
+        {
+          res.push_back(training.category_names[training.categories[neighbours[j].index]]);
+          break;
+        }
+    }
+
+    for(const auto& n : neighbours)
+      counts[training.categories[n.index]] = 0;
+
+    return res;
+  }
+
+  // majority vote among the neighbours, a tie goes to the category
+  // of the nearest neighbour
+  std::string vote(const std::vector<Neighbour>& neighbours) const
+  {
+    stats::Timer timer(stats::QUERY_VOTE);
+    stats::count(stats::QUERIES, 1);
+    static thread_local std::vector<int> counts;
+    counts.resize(training.category_names.size(), 0);
+
+    int max = 0;
+    for(const auto& n : neighbours)
+      max = std::max(max, ++counts[training.categories[n.index]]);
+
+    std::string res = "";
+    for(const auto& n : neighbours)
+      if(counts[training.categories[n.index]] == max)
       {
-        res = i.first;
-        max = i.second;
+        res = training.category_names[training.categories[n.index]];
+        break;
       }
-    }
 
+    for(const auto& n : neighbours)
+      counts[training.categories[n.index]] = 0;
 
     return res;
   }
@@ -276,4 +1373,34 @@ string2dt(
       {"euclidean", EUCLIDEAN},
       {"cosine", COSINE}
     });
+
+std::map<index_type, std::string>
+it2string(
+    {
+      {BRUTE_FORCE, "none"},
+      {INVERTED, "inverted"},
+      {LSH, "lsh"},
+      {HNSW, "hnsw"},
+      {IVF, "ivf"},
+      {VP_TREE, "vptree"}
+    });
+
+std::map<std::string, precision_type>
+string2precision(
+    {
+      {"double", FLOAT64},
+      {"float", FLOAT32},
+      {"int8", INT8}
+    });
+
+std::map<std::string, index_type>
+string2it(
+    {
+      {"none", BRUTE_FORCE},
+      {"inverted", INVERTED},
+      {"lsh", LSH},
+      {"hnsw", HNSW},
+      {"ivf", IVF},
+      {"vptree", VP_TREE}
+    });
 }
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace knn {
+
+// splitmix64 finaliser: a cheap, well mixed hash of a 64 bit integer,
+// used where random numbers must be reproducible whatever the threading
+inline uint64_t mix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// a double uniformly drawn in (0, 1] from a hash
+inline double uniform(uint64_t hash)
+{
+  return ((hash >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+}
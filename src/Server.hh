@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "Example.hh"
+#include "Stats.hh"
+#include "Threads.hh"
+
+namespace knn {
+
+// a unix domain socket listening at path, -1 on an error
+inline int listen_socket(const std::string& path)
+{
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "ERROR: socket path %s is too long\n", path.c_str());
+    return -1;
+  }
+  strcpy(address.sun_path, path.c_str());
+
+  // a socket left by a previous server is replaced, any other file is kept
+  struct stat st;
+  if(stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0 || bind(fd, (sockaddr*) &address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+  {
+    fprintf(stderr, "ERROR: cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// answers the clients of a unix domain socket with a loaded predictor,
+// each client on its own thread: a client writes examples in the input
+// format, one per line, and reads back an 'id class' line for each, in
+// order; update lines ('+ <example>', '- <id>', see Predictor::update)
+// and the '?' line, answered by the stats report, are answered in turn,
+// once the examples sent before them
+// the lines a client has sent are answered together, by batches of at
+// most batch examples, their search being split on the predictor's pool
+// which all clients share
+template<class Predictor>
+struct Server
+{
+  Predictor& predictor;
+  std::string path;
+  unsigned batch;
+
+  Server(Predictor& p, const std::string& socket_path, unsigned b)
+      : predictor(p), path(socket_path), batch(b) {};
+
+  // accept clients until an error occurs, returns false then
+  bool serve()
+  {
+    int fd = listen_socket(path);
+    if(fd < 0)
+      return false;
+
+    fprintf(stderr, "serving on %s\n", path.c_str());
+
+    while(1)
+    {
+      int client_fd = accept(fd, NULL, NULL);
+      if(client_fd < 0)
+      {
+        if(errno == EINTR || errno == ECONNABORTED)
+          continue;
+        fprintf(stderr, "ERROR: accept failed on %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+      }
+      threadns::thread(&Server::client, this, client_fd).detach();
+    }
+  }
+
+  static bool write_all(int fd, const std::string& s)
+  {
+    size_t done = 0;
+    while(done < s.size())
+    {
+      ssize_t n = send(fd, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return false;
+      done += n;
+    }
+    return true;
+  }
+
+  // answer the examples read so far and forget them; a predictor that
+  // fails (a coordinator whose shard failed) returns no predictions, the
+  // client is told and let go
+  bool answer(int fd, std::vector<Example>* examples) const
+  {
+    if(examples->empty())
+      return true;
+
+    std::vector<std::string> hyps = predictor.predict(*examples);
+    if(hyps.size() != examples->size())
+    {
+      write_all(fd, "! the search failed\n");
+      return false;
+    }
+    std::string out;
+    for(size_t i = 0; i < examples->size(); ++i)
+      out += (*examples)[i].id + " " + hyps[i] + "\n";
+
+    examples->clear();
+    return write_all(fd, out);
+  }
+
+  static bool is_stats_request(const char* begin, const char* end)
+  {
+    return end - begin == 1 && *begin == '?';
+  }
+
+  void client(int fd) const
+  {
+    std::vector<Example> examples;
+    std::string reply;
+    std::string pending;  // the start of a line not yet complete
+    char buffer[1 << 16];
+    bool ok = true;
+
+    while(ok)
+    {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        break;
+      pending.append(buffer, n);
+
+      size_t begin = 0, eol;
+      while(ok && (eol = pending.find('\n', begin)) != std::string::npos)
+      {
+        if(Predictor::is_update(pending.data() + begin, pending.data() + eol))
+        {
+          ok = answer(fd, &examples);
+          predictor.update(pending.data() + begin, pending.data() + eol, &reply);
+          ok = ok && write_all(fd, reply + "\n");
+          begin = eol + 1;
+          continue;
+        }
+
+        if(is_stats_request(pending.data() + begin, pending.data() + eol))
+        {
+          ok = answer(fd, &examples) && write_all(fd, stats::report() + "\n");
+          begin = eol + 1;
+          continue;
+        }
+
+        examples.emplace_back();
+        predictor.load_query(pending.data() + begin, pending.data() + eol + 1, &examples.back());
+        begin = eol + 1;
+        if(examples.size() == batch)
+          ok = answer(fd, &examples);
+      }
+      pending.erase(0, begin);
+
+      // the lines of this read are answered without waiting for more
+      ok = ok && answer(fd, &examples);
+    }
+
+    // a last line without its newline
+    if(ok && Predictor::is_update(pending.data(), pending.data() + pending.size()))
+    {
+      predictor.update(pending.data(), pending.data() + pending.size(), &reply);
+      write_all(fd, reply + "\n");
+    }
+    else if(ok && is_stats_request(pending.data(), pending.data() + pending.size()))
+      write_all(fd, stats::report() + "\n");
+    else if(ok && !pending.empty())
+    {
+      examples.emplace_back();
+      predictor.load_query(pending.data(), pending.data() + pending.size(), &examples.back());
+      answer(fd, &examples);
+    }
+
+    close(fd);
+  }
+};
+
+}
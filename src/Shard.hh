@@ -0,0 +1,653 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "Example.hh"
+#include "TopK.hh"
+#include "Predictor.hh"
+#include "Message.hh"
+#include "ModelFile.hh"
+#include "ExampleMaker.hh"
+#include "Server.hh"
+#include "Threads.hh"
+
+// a coordinator waits that long for the sockets of its shards
+#define SHARD_CONNECT_SECONDS 60
+
+namespace knn {
+
+// a training file split between processes: each shard holds the rows of
+// one part of the file and answers the searches of a coordinator, which
+// merges their neighbours
+// the shards are loaded in steps with the coordinator, so that they end
+// up with the feature ids, noise filter and normaliser of a single
+// process loading the whole file:
+// - each shard parses its part, then in file order the coordinator hands
+//   each the dictionary of the parts before it, to which it adds its own
+// - once every part is merged, each shard gets the whole dictionary and
+//   removes its rare features
+// - likewise, the running statistics of the normaliser go from shard to
+//   shard in file order, those of every row then apply on all of them
+// a neighbour carries its row index in the whole file, ties are broken
+// on it as in a single process: with exact searches, the coordinator
+// finds the neighbours a single process would
+// the coordinator first checks that the shards search as it was told to
+// (their distances could not be compared otherwise) and hold the parts
+// of the file in the order it was given them, of its training file if
+// it was given one
+// once loaded, a shard answers the next coordinator when one leaves:
+// the hello of a loaded shard carries what the loading would give
+enum ShardRequest
+{
+  SHARD_HELLO,       // k, distance, index, precision, file -> error, part, parts, loaded
+                     // (and if loaded: rows, first row, dictionary, running statistics)
+  SHARD_DICTIONARY,  // first row, dictionary so far -> rows, dictionary
+  SHARD_NOISE,       // whole dictionary -> nothing
+  SHARD_NORMALISER,  // running statistics so far -> running statistics
+  SHARD_BUILD,       // running statistics of every row -> nothing
+  SHARD_SEARCH       // queries -> neighbours of each
+};
+
+// the global dictionary, feature names by id and their counts
+inline void write_dictionary(Message* m)
+{
+  std::vector<std::string> names(counter);
+  for(const auto& f : string_map)
+    names[f.second] = f.first;
+  std::vector<double> counts(counter, 0);
+  for(const auto& c : count_map)
+    if(c.first >= 0 && c.first < counter)
+      counts[c.first] = c.second;
+
+  m->write_strings(names);
+  m->write_vector(counts);
+  m->write_value<int32_t>(count_map_counter);
+}
+
+inline void read_dictionary(Message* m)
+{
+  std::vector<std::string> names;
+  std::vector<double> counts;
+  m->read_strings(&names);
+  m->read_vector(&counts);
+  int total = m->read_value<int32_t>();
+  if(!m->ok || counts.size() != names.size())
+  {
+    m->ok = false;
+    return;
+  }
+
+  string_map.clear();
+  count_map.clear();
+  for(size_t i = 0; i < names.size(); ++i)
+  {
+    string_map[names[i]] = i;
+    count_map[i] = counts[i];
+  }
+  counter = names.size();
+  count_map_counter = total;
+}
+
+// the device and inode of a file, which identify it on the machine the
+// shards and the coordinator share; 0 0 for no file or an error
+inline void write_file_identity(const std::string& filename, Message* m)
+{
+  struct stat st;
+  bool found = !filename.empty() && stat(filename.c_str(), &st) == 0;
+  m->write_value<uint64_t>(found ? st.st_dev : 0);
+  m->write_value<uint64_t>(found ? st.st_ino : 0);
+}
+
+// a unix domain socket connected to path, -1 on an error
+inline int connect_socket(const std::string& path)
+{
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(address.sun_path))
+    return -1;
+  strcpy(address.sun_path, path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd >= 0 && connect(fd, (sockaddr*) &address, sizeof(address)) != 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// part of parts of a training file in predictor, loaded and searched on
+// behalf of the coordinators connecting to the socket at path, one after
+// the other; the shard ends if a coordinator leaves while loading it
+template<class Predictor>
+struct Shard
+{
+  Predictor& predictor;
+  std::string filename;
+  std::string path;
+  unsigned part;
+  unsigned parts;
+
+  size_t first_row;  // the index of the first row of the part in the file
+  std::vector<ExampleMaker> makers;
+  std::vector<std::vector<unsigned> > global_ids;
+  bool loading;  // between SHARD_DICTIONARY and SHARD_BUILD
+  bool loaded;
+
+  Shard(Predictor& p, const std::string& training_file, const std::string& socket_path,
+        unsigned i, unsigned n)
+      : predictor(p), filename(training_file), path(socket_path), part(i), parts(n),
+        first_row(0), makers(), global_ids(), loading(false), loaded(false) {};
+
+  bool serve()
+  {
+    // the coordinator may connect while the part is parsed
+    int fd = listen_socket(path);
+    if(fd < 0)
+      return false;
+
+    fprintf(stderr, "shard %u/%u listening on %s\n", part, parts, path.c_str());
+
+    MappedFile file;
+    if(!file.open(filename)) {
+      fprintf(stderr, "ERROR: cannot load model from \"%s\"\n", filename.c_str());
+      close(fd);
+      return false;
+    }
+    std::vector<const char*> bounds = split_lines(file.address,
+                                                  examples_end(file.address, file.address + file.length),
+                                                  parts);
+    makers = predictor.parse_examples(bounds[part], bounds[part + 1]);
+
+    while(1)
+    {
+      int coordinator;
+      while((coordinator = accept(fd, NULL, NULL)) < 0 && (errno == EINTR || errno == ECONNABORTED))
+        ;
+      if(coordinator < 0)
+      {
+        fprintf(stderr, "ERROR: accept failed on %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return false;
+      }
+
+      Message request, reply;
+      bool ok = true;
+      while(ok && request.receive(coordinator))
+      {
+        reply = Message();
+        ok = answer(&request, &reply) && reply.send(coordinator);
+      }
+      close(coordinator);
+
+      if(!ok)
+        fprintf(stderr, "ERROR: shard %u/%u: bad request from the coordinator\n", part, parts);
+
+      // the parts are loaded together, a coordinator cannot resume that of another
+      if(loading)
+      {
+        fprintf(stderr, "ERROR: shard %u/%u: the coordinator left while loading the shards\n", part, parts);
+        close(fd);
+        return false;
+      }
+      fprintf(stderr, "shard %u/%u: waiting for the next coordinator\n", part, parts);
+    }
+  }
+
+  bool answer(Message* request, Message* reply)
+  {
+    uint8_t type = request->read_value<uint8_t>();
+    // loading requests on a loaded shard, or searches on one not loaded
+    if(type != SHARD_HELLO && loaded != (type == SHARD_SEARCH))
+      return false;
+
+    switch(type)
+    {
+      case SHARD_HELLO:
+        return hello(request, reply);
+
+      case SHARD_DICTIONARY:
+        loading = true;
+        first_row = request->read_value<uint64_t>();
+        read_dictionary(request);
+        if(!request->ok)
+          return false;
+        global_ids = predictor.merge_dictionaries(makers);
+        {
+          uint64_t rows = 0;
+          for(const auto& m : makers)
+            rows += m.examples.size();
+          reply->write_value(rows);
+        }
+        write_dictionary(reply);
+        return true;
+
+      case SHARD_NOISE:
+        read_dictionary(request);
+        if(!request->ok)
+          return false;
+        predictor.add_examples(&makers, global_ids);
+        makers.clear();
+        global_ids.clear();
+        return true;
+
+      case SHARD_NORMALISER:
+        predictor.normaliser.read_running(request);
+        if(!request->ok)
+          return false;
+        for(size_t r = 0; r < predictor.training.size(); ++r)
+          predictor.normaliser.add(predictor.training.row(r));
+        predictor.normaliser.write_running(reply);
+        return true;
+
+      case SHARD_BUILD:
+        predictor.normaliser.read_running(request);
+        if(!request->ok)
+          return false;
+        predictor.normaliser.apply();
+        predictor.normaliser.normalise(&predictor.training);
+        predictor.training.update_norms();
+        predictor.fitted = true;
+        predictor.build();
+        loading = false;
+        loaded = true;
+        fprintf(stderr, "shard %u/%u: %lu examples from row %lu\n", part, parts,
+                predictor.training.size(), first_row);
+        return true;
+
+      case SHARD_SEARCH:
+        return search(request, reply);
+    }
+    return false;
+  }
+
+  // the error is empty if the coordinator searches as the shard does,
+  // its k is then that of the shard
+  bool hello(Message* request, Message* reply)
+  {
+    unsigned k = request->read_value<uint32_t>();
+    distance_type dt = (distance_type) request->read_value<uint8_t>();
+    index_type it = (index_type) request->read_value<uint8_t>();
+    precision_type precision = (precision_type) request->read_value<uint8_t>();
+    uint64_t device = request->read_value<uint64_t>();
+    uint64_t inode = request->read_value<uint64_t>();
+    if(!request->ok)
+      return false;
+
+    Message identity;
+    write_file_identity(filename, &identity);
+
+    std::string error;
+    if(dt != predictor.dt || it != predictor.it || precision != predictor.options.precision)
+    {
+      error = "the shard searches with --distance " + dt2string.at(predictor.dt) +
+          " --index " + it2string.at(predictor.it) + " --precision ";
+      for(const auto& p : string2precision)
+        if(p.second == predictor.options.precision)
+          error += p.first;
+    }
+    else if((device || inode) &&
+            (identity.read_value<uint64_t>() != device || identity.read_value<uint64_t>() != inode))
+      error = "the shard holds a part of " + filename + ", not of the --train file of the coordinator";
+    else
+      predictor.k = k;
+
+    reply->write_string(error);
+    reply->write_value<uint32_t>(part);
+    reply->write_value<uint32_t>(parts);
+    reply->write_value<uint8_t>(loaded);
+    if(loaded)
+    {
+      reply->write_value<uint64_t>(predictor.training.size());
+      reply->write_value<uint64_t>(first_row);
+      write_dictionary(reply);
+      predictor.normaliser.write_running(reply);
+    }
+    return true;
+  }
+
+  // queries: their number, then the ids and values of each
+  // neighbours: their number for each query, then their distance, row
+  // index in the whole file and category
+  bool search(Message* request, Message* reply) const
+  {
+    std::vector<Example> queries(request->read_value<uint64_t>());
+    std::vector<unsigned> ids;
+    std::vector<double> values;
+    for(auto& q : queries)
+    {
+      request->read_vector(&ids);
+      request->read_vector(&values);
+      if(!request->ok || ids.size() != values.size())
+        return false;
+      for(size_t i = 0; i < ids.size(); ++i)
+        q.features.emplace_back(ids[i], values[i]);
+    }
+
+    std::vector<std::vector<Neighbour> > neighbours = predictor.neighbours(queries);
+    for(const auto& l : neighbours)
+    {
+      reply->write_value<uint64_t>(l.size());
+      for(const auto& n : l)
+      {
+        reply->write_value(n.distance);
+        reply->write_value<uint64_t>(first_row + n.index);
+        reply->write_string(predictor.training.category(n.index));
+      }
+    }
+    return true;
+  }
+};
+
+// the front of shards: loads them, then answers the queries in their
+// place, with the interface of a Predictor for Server; a search is sent
+// to every shard at once, searches follow each other on the connections
+template<class Normaliser>
+struct Coordinator
+{
+  // a neighbour found by a shard
+  struct Remote
+  {
+    Neighbour neighbour;
+    std::string category;
+
+    Remote(double d, size_t i, const std::string& c) : neighbour(d, i), category(c) {};
+
+    bool operator<(const Remote& o) const { return neighbour < o.neighbour; }
+  };
+
+  std::vector<std::string> paths;
+  unsigned k;
+  distance_type dt;
+  index_type it;
+  precision_type precision;
+  std::string filename;
+  std::vector<int> fds;
+  Normaliser normaliser;
+  mutable threadns::mutex mutex;
+  mutable bool broken;  // a search failed, the connections are out of step
+
+  // the shards must search with DT, IT and precision P, and hold the
+  // parts of training_file unless it is empty
+  Coordinator(const std::vector<std::string>& shard_paths, unsigned K, distance_type DT, index_type IT,
+              precision_type P, const std::string& training_file)
+      : paths(shard_paths), k(K), dt(DT), it(IT), precision(P), filename(training_file), fds(),
+        normaliser(), mutex(), broken(false) {};
+
+  ~Coordinator()
+  {
+    for(const auto& fd : fds)
+      close(fd);
+  }
+
+  // connect to the shards and load them, false on an error
+  bool start()
+  {
+    for(const auto& p : paths)
+    {
+      int fd = -1;
+      for(int i = 0; i < 10 * SHARD_CONNECT_SECONDS && (fd = connect_socket(p)) < 0; ++i)
+        usleep(100000);
+      if(fd < 0)
+      {
+        fprintf(stderr, "ERROR: cannot connect to shard %s: %s\n", p.c_str(), strerror(errno));
+        return false;
+      }
+      fds.push_back(fd);
+    }
+
+    // the shards loaded by a previous coordinator give the rows, dictionary
+    // and statistics the loading would
+    uint64_t rows = 0;
+    size_t loaded = 0;
+    for(size_t s = 0; s < fds.size(); ++s)
+    {
+      Message request, reply;
+      request.write_value<uint8_t>(SHARD_HELLO);
+      request.write_value<uint32_t>(k);
+      request.write_value<uint8_t>(dt);
+      request.write_value<uint8_t>(it);
+      request.write_value<uint8_t>(precision);
+      write_file_identity(filename, &request);
+      if(!exchange(s, request, &reply))
+        return false;
+      std::string error = reply.read_string();
+      unsigned part = reply.read_value<uint32_t>();
+      unsigned parts = reply.read_value<uint32_t>();
+      if(!reply.ok)
+        return failed(s);
+      if(!error.empty())
+      {
+        fprintf(stderr, "ERROR: shard %s: %s\n", paths[s].c_str(), error.c_str());
+        return false;
+      }
+      if(part != s || parts != fds.size())
+      {
+        fprintf(stderr, "ERROR: shard %s holds part %u/%u, not %lu/%lu\n", paths[s].c_str(), part, parts,
+                s, fds.size());
+        return false;
+      }
+
+      if(reply.read_value<uint8_t>())
+      {
+        ++loaded;
+        uint64_t shard_rows = reply.read_value<uint64_t>();
+        if(reply.read_value<uint64_t>() != rows)
+          return failed(s);
+        rows += shard_rows;
+        read_dictionary(&reply);
+        normaliser.read_running(&reply);
+        if(!reply.ok)
+          return failed(s);
+      }
+    }
+
+    if(loaded && loaded < fds.size())
+    {
+      fprintf(stderr, "ERROR: some shards are already loaded and others not, start them again together\n");
+      return false;
+    }
+    if(loaded)
+    {
+      normaliser.apply();
+      fprintf(stderr, "%lu examples on %lu loaded shards\n", rows, fds.size());
+      return true;
+    }
+
+    // the dictionary and the statistics go from shard to shard in file order
+    for(size_t s = 0; s < fds.size(); ++s)
+    {
+      Message request, reply;
+      request.write_value<uint8_t>(SHARD_DICTIONARY);
+      request.write_value(rows);
+      write_dictionary(&request);
+      if(!exchange(s, request, &reply))
+        return false;
+      rows += reply.read_value<uint64_t>();
+      read_dictionary(&reply);
+      if(!reply.ok)
+        return failed(s);
+    }
+
+    Message noise;
+    noise.write_value<uint8_t>(SHARD_NOISE);
+    write_dictionary(&noise);
+    if(!broadcast(noise))
+      return false;
+
+    for(size_t s = 0; s < fds.size(); ++s)
+    {
+      Message request, reply;
+      request.write_value<uint8_t>(SHARD_NORMALISER);
+      normaliser.write_running(&request);
+      if(!exchange(s, request, &reply))
+        return false;
+      normaliser.read_running(&reply);
+      if(!reply.ok)
+        return failed(s);
+    }
+    normaliser.apply();
+
+    Message build;
+    build.write_value<uint8_t>(SHARD_BUILD);
+    normaliser.write_running(&build);
+    if(!broadcast(build))
+      return false;
+
+    fprintf(stderr, "%lu examples on %lu shards\n", rows, fds.size());
+    return true;
+  }
+
+  bool failed(size_t s) const
+  {
+    fprintf(stderr, "ERROR: shard %s failed\n", paths[s].c_str());
+    return false;
+  }
+
+  bool exchange(size_t s, const Message& request, Message* reply) const
+  {
+    return (request.send(fds[s]) && reply->receive(fds[s])) || failed(s);
+  }
+
+  // the same request to every shard, the shards work on it together
+  bool broadcast(const Message& request) const
+  {
+    for(size_t s = 0; s < fds.size(); ++s)
+      if(!request.send(fds[s]))
+        return failed(s);
+    Message reply;
+    for(size_t s = 0; s < fds.size(); ++s)
+      if(!reply.receive(fds[s]))
+        return failed(s);
+    return true;
+  }
+
+  // read a query as a Predictor does, with the dictionary and
+  // normaliser statistics of every shard
+  void load_query(const char* begin, const char* end, Example* example) const
+  {
+    example->load(begin, end, true, false);
+    example->remove_noise(0.0001);
+    normaliser.normalise(example);
+  }
+
+  // the k nearest rows of each query among those of every shard, nearest
+  // first; false if a shard failed, every later search fails then
+  bool neighbours(const std::vector<Example>& queries, std::vector<std::vector<Remote> >* neighbours) const
+  {
+    std::vector<std::vector<Remote> >& res = *neighbours;
+    res.assign(queries.size(), std::vector<Remote>());
+
+    Message request;
+    request.write_value<uint8_t>(SHARD_SEARCH);
+    request.write_value<uint64_t>(queries.size());
+    std::vector<unsigned> ids;
+    std::vector<double> values;
+    for(const auto& q : queries)
+    {
+      ids.clear();
+      values.clear();
+      for(const auto& f : q.features)
+      {
+        ids.push_back(f.id);
+        values.push_back(f.value);
+      }
+      request.write_vector(ids);
+      request.write_vector(values);
+    }
+
+    lock_type lock(mutex);
+    if(broken || !broadcast_search(request, &res))
+    {
+      broken = true;
+      return false;
+    }
+
+    for(auto& l : res)
+    {
+      std::sort(l.begin(), l.end());
+      if(l.size() > k)
+        l.erase(l.begin() + k, l.end());
+    }
+    return true;
+  }
+
+  bool broadcast_search(const Message& request, std::vector<std::vector<Remote> >* res) const
+  {
+    for(size_t s = 0; s < fds.size(); ++s)
+      if(!request.send(fds[s]))
+        return failed(s);
+
+    Message reply;
+    for(size_t s = 0; s < fds.size(); ++s)
+    {
+      if(!reply.receive(fds[s]))
+        return failed(s);
+      for(auto& l : *res)
+      {
+        uint64_t n = reply.read_value<uint64_t>();
+        for(uint64_t i = 0; reply.ok && i < n; ++i)
+        {
+          double distance = reply.read_value<double>();
+          uint64_t index = reply.read_value<uint64_t>();
+          l.push_back(Remote(distance, index, reply.read_string()));
+        }
+      }
+      if(!reply.ok)
+        return failed(s);
+    }
+    return true;
+  }
+
+  // majority vote as Predictor::vote, a tie goes to the category of the
+  // nearest neighbour
+  static std::string vote(const std::vector<Remote>& neighbours)
+  {
+    std::unordered_map<std::string, int> counts;
+    int max = 0;
+    for(const auto& n : neighbours)
+      max = std::max(max, ++counts[n.category]);
+
+    for(const auto& n : neighbours)
+      if(counts[n.category] == max)
+        return n.category;
+    return "";
+  }
+
+  // the predictions, none if a shard failed
+  std::vector<std::string> predict(const std::vector<Example>& queries) const
+  {
+    std::vector<std::vector<Remote> > n;
+    std::vector<std::string> res;
+    if(neighbours(queries, &n))
+      for(const auto& l : n)
+        res.push_back(vote(l));
+    return res;
+  }
+
+  static bool is_update(const char* begin, const char* end)
+  {
+    return Predictor<Normaliser>::is_update(begin, end);
+  }
+
+  // the shards hold a fixed training set
+
+  void update(const char*, const char*, std::string* reply) const
+  {
+    *reply = "! updates are not supported with shards";
+  }
+};
+
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+#include "Threads.hh"
+
+namespace knn {
+namespace stats {
+
+// time spent in the stages of loading and querying, and work counters,
+// collected when enabled (--stats)
+// each thread adds to a slot of its own, without locks: a slot has a
+// single writer, its atomics only make the reads of the report safe;
+// the slot of a thread that ends is handed to the next one, so that
+// short-lived threads (server clients) do not pile up slots
+
+enum stage
+{
+  LOAD_READ,            // mapping the training file and splitting it
+  LOAD_PARSE,           // Example::load of the training examples
+  LOAD_DICTIONARY,      // merging the feature dictionaries of the parsers
+  LOAD_NOISE,           // remove_noise on the training examples
+  LOAD_NORMALISER_FIT,  // statistics of the normaliser
+  DICTIONARY_WAIT,      // waiting for the global dictionary lock
+  QUERY_PARSE,          // Example::load of the queries
+  QUERY_NORMALISE,      // remove_noise and normalisation of the queries
+  QUERY_SCAN,           // distances to the training rows (or index search)
+  QUERY_SELECT,         // merging the per-worker top-k and rescoring
+  QUERY_VOTE,           // majority vote
+  NUM_STAGES
+};
+
+enum counter
+{
+  EXAMPLES_SCANNED,  // training rows compared with a query
+  FEATURE_PAIRS,     // features shared by a query and the rows it was compared with
+  QUERIES,
+  NUM_COUNTERS
+};
+
+static const char* stage_names[NUM_STAGES] =
+{
+  "load_read", "load_parse", "load_dictionary", "load_noise", "load_normaliser_fit", "dictionary_wait",
+  "query_parse", "query_normalise", "query_scan", "query_select", "query_vote"
+};
+
+static const char* counter_names[NUM_COUNTERS] = { "examples_scanned", "feature_pairs", "queries" };
+
+// durations are counted in buckets of powers of 2 nanoseconds, bucket b
+// holding those below 2^b
+#define HISTOGRAM_BUCKETS 40
+
+struct Slot
+{
+  std::atomic<uint64_t> calls[NUM_STAGES];
+  std::atomic<uint64_t> nanoseconds[NUM_STAGES];
+  std::atomic<uint64_t> histograms[NUM_STAGES][HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> counters[NUM_COUNTERS];
+
+  Slot()
+  {
+    for(int s = 0; s < NUM_STAGES; ++s)
+    {
+      calls[s].store(0);
+      nanoseconds[s].store(0);
+      for(int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+        histograms[s][b].store(0);
+    }
+    for(int c = 0; c < NUM_COUNTERS; ++c)
+      counters[c].store(0);
+  }
+};
+
+bool enabled = false;
+
+threadns::mutex slots_mutex;
+std::vector<Slot*> slots;       // every slot, never freed
+std::vector<Slot*> free_slots;  // those of the threads that ended
+
+// the slot of the calling thread, for as long as it runs
+struct SlotOwner
+{
+  Slot* slot;
+
+  SlotOwner() : slot(NULL)
+  {
+    lock_type lock(slots_mutex);
+    if(free_slots.empty())
+    {
+      slots.push_back(new Slot());
+      free_slots.push_back(slots.back());
+    }
+    slot = free_slots.back();
+    free_slots.pop_back();
+  }
+
+  ~SlotOwner()
+  {
+    lock_type lock(slots_mutex);
+    free_slots.push_back(slot);
+  }
+};
+
+inline Slot& local()
+{
+  static thread_local SlotOwner owner;
+  return *owner.slot;
+}
+
+// only the owner of a slot writes to it
+inline void add(std::atomic<uint64_t>& a, uint64_t n)
+{
+  a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void count(counter c, uint64_t n)
+{
+  if(enabled)
+    add(local().counters[c], n);
+}
+
+inline void record(stage s, uint64_t nanoseconds)
+{
+  Slot& slot = local();
+  int bucket = 0;
+  while(bucket < HISTOGRAM_BUCKETS - 1 && (nanoseconds >> bucket) != 0)
+    ++bucket;
+  add(slot.calls[s], 1);
+  add(slot.nanoseconds[s], nanoseconds);
+  add(slot.histograms[s][bucket], 1);
+}
+
+// records the time from its construction to its destruction in a stage
+struct Timer
+{
+  stage s;
+  bool on;
+  std::chrono::steady_clock::time_point start;
+
+  Timer(stage st) : s(st), on(enabled), start()
+  {
+    if(on)
+      start = std::chrono::steady_clock::now();
+  }
+
+  ~Timer() { stop(); }
+
+  // record now rather than at destruction
+  void stop()
+  {
+    if(on)
+      record(s, std::chrono::duration_cast<std::chrono::nanoseconds>
+             (std::chrono::steady_clock::now() - start).count());
+    on = false;
+  }
+};
+
+// the sums over all the slots, as a one-line JSON object, threads being
+// the number of slots (threads that recorded, reused ones counted once):
+// {"threads": n, "stages": {name: {"calls", "seconds", "histogram_ns": {upper bound: calls}}},
+//  "counters": {name: value}}
+inline std::string report()
+{
+  lock_type lock(slots_mutex);
+  std::string res;
+  char buffer[128];
+
+  snprintf(buffer, sizeof(buffer), "{\"threads\": %lu, \"stages\": {", slots.size());
+  res += buffer;
+  for(int s = 0; s < NUM_STAGES; ++s)
+  {
+    uint64_t calls = 0, nanoseconds = 0;
+    std::vector<uint64_t> histogram(HISTOGRAM_BUCKETS, 0);
+    for(const auto& slot : slots)
+    {
+      calls += slot->calls[s].load(std::memory_order_relaxed);
+      nanoseconds += slot->nanoseconds[s].load(std::memory_order_relaxed);
+      for(int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+        histogram[b] += slot->histograms[s][b].load(std::memory_order_relaxed);
+    }
+
+    snprintf(buffer, sizeof(buffer), "%s\"%s\": {\"calls\": %lu, \"seconds\": %.9f, \"histogram_ns\": {",
+             s ? ", " : "", stage_names[s], calls, nanoseconds * 1e-9);
+    res += buffer;
+    bool first = true;
+    for(int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+      if(histogram[b])
+      {
+        snprintf(buffer, sizeof(buffer), "%s\"%lu\": %lu", first ? "" : ", ", uint64_t(1) << b, histogram[b]);
+        res += buffer;
+        first = false;
+      }
+    res += "}}";
+  }
+
+  res += "}, \"counters\": {";
+  for(int c = 0; c < NUM_COUNTERS; ++c)
+  {
+    uint64_t value = 0;
+    for(const auto& slot : slots)
+      value += slot->counters[c].load(std::memory_order_relaxed);
+    snprintf(buffer, sizeof(buffer), "%s\"%s\": %lu", c ? ", " : "", counter_names[c], value);
+    res += buffer;
+  }
+  res += "}}";
+
+  return res;
+}
+
+}
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <cstdio>
+
+#include "Threads.hh"
+
+namespace knn {
+
+// long-lived worker threads fed through a task queue
+// parallel_for hands out the chunks of one job and waits for them,
+// the calling thread runs queued tasks while it waits so that jobs
+// submitted from several threads (or from inside a task) cannot starve
+struct ThreadPool
+{
+  struct Task
+  {
+    std::function<void()> function;
+    int* pending;
+  };
+
+  std::vector<threadns::thread*> workers;
+  std::deque<Task> tasks;
+  threadns::mutex mutex;
+  threadns::condition_variable cond_task;
+  threadns::condition_variable cond_done;
+  bool stopping;
+  std::vector<int> cpus;  // the workers run on these if any, see Numa.hh
+
+  ThreadPool(int num_workers, const std::vector<int>& worker_cpus = std::vector<int>())
+      : workers(), tasks(), mutex(), cond_task(), cond_done(), stopping(false), cpus(worker_cpus)
+  {
+    for(int i = 0; i < num_workers; ++i)
+      workers.push_back(new threadns::thread(&ThreadPool::work, this));
+  }
+
+  ~ThreadPool()
+  {
+    lock_type lock(mutex);
+    stopping = true;
+    cond_task.notify_all();
+    lock.unlock();
+
+    for(auto& w : workers)
+    {
+      w->join();
+      delete w;
+    }
+  }
+
+  // run f(0) .. f(n-1) on the pool and the calling thread
+  void parallel_for(int n, const std::function<void(int)>& f)
+  {
+    int pending = n - 1;
+
+    if(pending > 0)
+      queue(1, n, f, &pending);
+
+    if(n > 0)
+      f(0);
+
+    lock_type lock(mutex);
+    while(pending > 0)
+    {
+      if(!tasks.empty())
+        run_one(lock);
+      else
+        cond_done.wait(lock);
+    }
+  }
+
+  // run f(0) .. f(n-1) on the workers alone, *pending set to n counts
+  // the tasks left, wait returns once it is 0; f must outlive the wait
+  // (the calling thread does not help: on pinned workers, the tasks
+  // would run off their cpus)
+  void submit(int n, const std::function<void(int)>& f, int* pending)
+  {
+    *pending = n;
+    if(n > 0)
+      queue(0, n, f, pending);
+  }
+
+  void wait(int* pending)
+  {
+    lock_type lock(mutex);
+    while(*pending > 0)
+      cond_done.wait(lock);
+  }
+
+  // queue f(first) .. f(n-1)
+  void queue(int first, int n, const std::function<void(int)>& f, int* pending)
+  {
+    lock_type lock(mutex);
+    for(int i = first; i < n; ++i)
+    {
+      Task t = { [&f, i]() { f(i); }, pending };
+      tasks.push_back(t);
+    }
+    cond_task.notify_all();
+  }
+
+  // pop and run the front task, lock is held on entry and on exit
+  void run_one(lock_type& lock)
+  {
+    Task t = tasks.front();
+    tasks.pop_front();
+    lock.unlock();
+
+    t.function();
+
+    lock.lock();
+    if(--*t.pending == 0)
+      cond_done.notify_all();
+  }
+
+  void work()
+  {
+    if(!cpus.empty() && !pin_thread(cpus))
+      fprintf(stderr, "ERROR: cannot pin a worker thread to its cpus\n");
+
+    lock_type lock(mutex);
+    while(1)
+    {
+      while(!stopping && tasks.empty())
+        cond_task.wait(lock);
+
+      if(tasks.empty())
+        break;
+
+      run_one(lock);
+    }
+  }
+};
+
+}
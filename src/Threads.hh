@@ -0,0 +1,72 @@
+#pragma once
+
+#ifdef USE_BOOST_THREAD
+#include <boost/thread.hpp>
+namespace threadns = boost;
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+namespace threadns = std;
+#endif
+
+typedef threadns::unique_lock<threadns::mutex> lock_type;
+
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+// restrict the calling thread to a set of cpus, false if the system refuses
+inline bool pin_thread(const std::vector<int>& cpus)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(const auto& c : cpus)
+    if(c >= 0 && c < CPU_SETSIZE)
+      CPU_SET(c, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// readers-writer lock (none in the standard library before c++14): any
+// number of readers or one writer; a waiting writer goes before new
+// readers, so a thread must not take it twice for reading
+struct SharedMutex
+{
+  pthread_rwlock_t rwlock;
+
+  SharedMutex()
+  {
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&rwlock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+  }
+
+  ~SharedMutex() { pthread_rwlock_destroy(&rwlock); }
+
+  void lock() { pthread_rwlock_wrlock(&rwlock); }
+  void unlock() { pthread_rwlock_unlock(&rwlock); }
+  void lock_shared() { pthread_rwlock_rdlock(&rwlock); }
+  void unlock_shared() { pthread_rwlock_unlock(&rwlock); }
+
+ private:
+  SharedMutex(const SharedMutex&);
+  SharedMutex& operator=(const SharedMutex&);
+};
+
+typedef threadns::unique_lock<SharedMutex> write_lock_type;
+
+struct read_lock_type
+{
+  SharedMutex& mutex;
+
+  read_lock_type(SharedMutex& m) : mutex(m) { mutex.lock_shared(); }
+  ~read_lock_type() { mutex.unlock_shared(); }
+
+ private:
+  read_lock_type(const read_lock_type&);
+  read_lock_type& operator=(const read_lock_type&);
+};
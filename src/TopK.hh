@@ -0,0 +1,131 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace knn {
+
+// a scored training row, ties are broken on the row index so that the
+// selected neighbours do not depend on how the rows were split between threads
+struct Neighbour
+{
+  double distance;
+  size_t index;
+
+  Neighbour(double d, size_t i) : distance(d), index(i) {};
+
+  inline bool operator<(const Neighbour& o) const
+  {
+    return distance < o.distance || (distance == o.distance && index < o.index);
+  }
+};
+
+// fixed-size max-heap keeping the k nearest rows seen so far
+// rows i with skip[i] set (removed from the training set) never enter it
+struct TopK
+{
+  unsigned k;
+  std::vector<Neighbour> heap;
+  const char* skip;
+
+  TopK(unsigned K, const char* s = NULL) : k(K), heap(), skip(s) { heap.reserve(K); };
+
+  bool full() const { return heap.size() >= k; }
+
+  // distance a row must beat to enter the heap
+  double bound() const
+  {
+    return (full() && k > 0) ? heap.front().distance : std::numeric_limits<double>::infinity();
+  }
+
+  inline void push(double distance, size_t index)
+  {
+    Neighbour n(distance, index);
+
+    if(heap.size() < k)
+    {
+      if(skip && skip[index])
+        return;
+      heap.push_back(n);
+      std::push_heap(heap.begin(), heap.end());
+    }
+    else if(k > 0 && n < heap.front())
+    {
+      if(skip && skip[index])
+        return;
+      std::pop_heap(heap.begin(), heap.end());
+      heap.back() = n;
+      std::push_heap(heap.begin(), heap.end());
+    }
+  }
+
+  void clear() { heap.clear(); }
+
+  // the neighbours, nearest first
+  std::vector<Neighbour> sorted() const
+  {
+    std::vector<Neighbour> res(heap);
+    std::sort_heap(res.begin(), res.end());
+    return res;
+  }
+};
+
+// k-way merge of the heaps filled by several workers, nearest first
+inline std::vector<Neighbour> merge(const std::vector<TopK>& heaps, unsigned k)
+{
+  std::vector<std::vector<Neighbour> > lists;
+  lists.reserve(heaps.size());
+  for(const auto& h : heaps)
+    lists.push_back(h.sorted());
+
+  std::vector<size_t> heads(lists.size(), 0);
+  std::vector<Neighbour> res;
+  res.reserve(k);
+
+  while(res.size() < k)
+  {
+    int best = -1;
+    for(size_t l = 0; l < lists.size(); ++l)
+    {
+      if(heads[l] < lists[l].size() &&
+         (best < 0 || lists[l][heads[l]] < lists[best][heads[best]]))
+        best = l;
+    }
+    if(best < 0)
+      break;
+    res.push_back(lists[best][heads[best]++]);
+  }
+
+  return res;
+}
+
+// the number of rows of a also in b
+inline size_t common(const std::vector<Neighbour>& a, const std::vector<Neighbour>& b)
+{
+  size_t res = 0;
+  for(const auto& x : a)
+    for(const auto& y : b)
+      if(x.index == y.index)
+      {
+        ++res;
+        break;
+      }
+  return res;
+}
+
+// neighbours without row, at most k of them, nearest first: a search
+// for k + 1 rows and the query row left out gives the k nearest others
+inline void exclude(std::vector<Neighbour>* neighbours, size_t row, size_t k)
+{
+  for(auto n = neighbours->begin(); n != neighbours->end(); ++n)
+    if(n->index == row)
+    {
+      neighbours->erase(n);
+      break;
+    }
+  if(neighbours->size() > k)
+    neighbours->erase(neighbours->begin() + k, neighbours->end());
+}
+
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+
+#include "Example.hh"
+#include "Array.hh"
+
+namespace knn {
+
+// training examples stored in compressed sparse row form:
+// the features of row i are feature_ids/values[offsets[i] .. offsets[i+1])
+// ids, categories and squared norms are kept in side tables indexed by row;
+// categories are interned, a row refers to its category by index
+struct TrainingSet
+{
+  Array<unsigned> feature_ids;
+  Array<double> values;
+  Array<size_t> offsets;
+  StringTable ids;
+  Array<unsigned> categories;
+  StringTable category_names;
+  std::unordered_map<std::string,unsigned> category_index;
+  Array<double> squared_norms;
+
+  TrainingSet() : feature_ids(), values(), offsets(), ids(), categories(), category_names(),
+                  category_index(), squared_norms()
+  {
+    offsets.push_back(0);
+  };
+
+  size_t size() const { return ids.size(); }
+
+  const char* category(size_t row) const { return category_names[categories[row]]; }
+
+  unsigned intern(const std::string& category)
+  {
+    // the index is not saved with a model, rebuild it after loading one
+    for(size_t i = category_index.size(); i < category_names.size(); ++i)
+      category_index[category_names[i]] = i;
+
+    auto res = category_index.insert(std::make_pair(category, (unsigned) category_names.size()));
+    if(res.second)
+      category_names.push_back(category);
+    return res.first->second;
+  }
+
+  size_t row_begin(size_t row) const { return offsets[row]; }
+  size_t row_end(size_t row) const { return offsets[row + 1]; }
+
+  SparseRow row(size_t i) const
+  {
+    SparseRow r = { feature_ids.data() + offsets[i], values.data() + offsets[i], offsets[i + 1] - offsets[i],
+                    squared_norms[i] };
+    return r;
+  }
+
+  void reserve(size_t rows, size_t features)
+  {
+    feature_ids.reserve(features);
+    values.reserve(features);
+    offsets.reserve(rows + 1);
+    ids.reserve(rows);
+    categories.reserve(rows);
+    squared_norms.reserve(rows);
+  }
+
+  // append an example (its features must be sorted by id), without its
+  // features if they are held elsewhere (see release_features)
+  void add(const Example& e, bool with_features = true)
+  {
+    if(with_features)
+      for(const auto& f : e.features)
+      {
+        feature_ids.push_back(f.id);
+        values.push_back(f.value);
+      }
+    squared_norms.push_back(kernels::squared_norm(values.data() + offsets.back(), values.size() - offsets.back()));
+    offsets.push_back(feature_ids.size());
+    ids.push_back(e.id);
+    categories.push_back(intern(e.category));
+  }
+
+  // append the rows of another training set
+  void append(const TrainingSet& t)
+  {
+    size_t shift = feature_ids.size();
+    feature_ids.append(t.feature_ids.data(), t.feature_ids.size());
+    values.append(t.values.data(), t.values.size());
+    for(size_t i = 1; i < t.offsets.size(); ++i)
+      offsets.push_back(t.offsets[i] + shift);
+    ids.append(t.ids);
+    std::vector<unsigned> category_ids(t.category_names.size());
+    for(size_t i = 0; i < category_ids.size(); ++i)
+      category_ids[i] = intern(t.category_names[i]);
+    for(size_t i = 0; i < t.size(); ++i)
+      categories.push_back(category_ids[t.categories[i]]);
+    squared_norms.append(t.squared_norms.data(), t.squared_norms.size());
+  }
+
+  // append the rows [begin, end) of another training set
+  void append(const TrainingSet& t, size_t begin, size_t end)
+  {
+    size_t first = t.offsets[begin];
+    size_t base = feature_ids.size();
+    feature_ids.append(t.feature_ids.data() + first, t.offsets[end] - first);
+    values.append(t.values.data() + first, t.offsets[end] - first);
+    for(size_t i = begin; i < end; ++i)
+    {
+      offsets.push_back(t.offsets[i + 1] - first + base);
+      ids.push_back(t.ids[i]);
+      categories.push_back(intern(t.category(i)));
+    }
+    squared_norms.append(t.squared_norms.data() + begin, end - begin);
+  }
+
+  // renumber the features, the rows are sorted again by their new ids
+  void remap_features(const std::vector<unsigned>& new_ids)
+  {
+    unsigned* f = feature_ids.mutable_data();
+    double* v = values.mutable_data();
+    std::vector<Feature> row;
+
+    for(size_t i = 0; i < size(); ++i)
+    {
+      row.clear();
+      for(size_t j = offsets[i]; j < offsets[i + 1]; ++j)
+        row.emplace_back(new_ids[f[j]], v[j]);
+      std::sort(row.begin(), row.end());
+      for(size_t j = 0; j < row.size(); ++j)
+      {
+        f[offsets[i] + j] = row[j].id;
+        v[offsets[i] + j] = row[j].value;
+      }
+    }
+  }
+
+  // drop the features too rare in the training data, rows are compacted in place
+  void remove_noise(double threshold)
+  {
+    unsigned* f = feature_ids.mutable_data();
+    double* v = values.mutable_data();
+    size_t* o = offsets.mutable_data();
+    size_t kept = 0;
+
+    for(size_t i = 0; i < size(); ++i)
+    {
+      size_t begin = o[i], end = o[i + 1];
+      o[i] = kept;
+      for(size_t j = begin; j < end; ++j)
+        if(!is_noise(f[j], threshold))
+        {
+          f[kept] = f[j];
+          v[kept] = v[j];
+          ++kept;
+        }
+    }
+    o[size()] = kept;
+
+    feature_ids.resize(kept);
+    values.resize(kept);
+    update_norms();
+  }
+
+  // drop the features of the rows, held elsewhere from then on (see
+  // NumaStore): the rows read empty, those appended afterwards keep theirs
+  void release_features()
+  {
+    feature_ids = Array<unsigned>();
+    values = Array<double>();
+    offsets.assign(size() + 1, 0);
+  }
+
+  // to be called once the values have been modified (by a normaliser)
+  void update_norms()
+  {
+    double* norms = squared_norms.mutable_data();
+    for(size_t i = 0; i < size(); ++i)
+      norms[i] = kernels::squared_norm(values.data() + offsets[i], offsets[i + 1] - offsets[i]);
+  }
+};
+
+
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "Example.hh"
+#include "TrainingSet.hh"
+#include "ThreadPool.hh"
+#include "TopK.hh"
+#include "Random.hh"
+
+// rows of a subtree below which it is left as a leaf and scanned
+#define VP_LEAF_SIZE 16
+
+// subtrees of at least that many rows are built in parallel
+#define VP_PARALLEL_SIZE 4096
+
+namespace knn {
+
+// vantage point tree for exact euclidean search: a node splits its rows
+// at the median distance to a vantage row, the inside child holding the
+// rows nearer than the median; by the triangle inequality a child cannot
+// hold a row within tau of the query if the query's distance to the
+// vantage row differs from the median by more than tau, where tau is
+// the distance of the k-th nearest row found so far
+// the rows of a node are order[begin .. end), the vantage row first;
+// a leaf has no children and its rows are scanned
+// the rows added to the training set after the build are scanned by
+// every search, before the tree so as to tighten its bound
+struct VpTree
+{
+  struct Node
+  {
+    size_t begin;
+    size_t end;
+    double radius;
+    int inside;
+    int outside;
+  };
+
+  // search counters, summed over all queries
+  struct Stats
+  {
+    size_t queries;
+    size_t visited;  // rows whose distance was computed
+    size_t pruned;   // subtrees skipped
+  };
+
+  const TrainingSet* training;
+  std::vector<unsigned> order;
+  std::vector<Node> nodes;
+  std::vector<unsigned> added;
+  unsigned num_nodes;
+  threadns::mutex nodes_mutex;
+
+  mutable Stats stats;
+  mutable threadns::mutex stats_mutex;
+
+  VpTree() : training(NULL), order(), nodes(), added(), num_nodes(0), nodes_mutex(), stats(), stats_mutex()
+  {
+    stats.queries = stats.visited = stats.pruned = 0;
+  };
+
+  // the euclidean distance itself, the triangle inequality does not hold
+  // for its square
+  static double distance(const SparseRow& a, const SparseRow& b)
+  {
+    return std::sqrt(kernels::euclidean(a, b));
+  }
+
+  unsigned allocate()
+  {
+    lock_type lock(nodes_mutex);
+    return num_nodes++;
+  }
+
+  void build(const TrainingSet& t, ThreadPool* pool)
+  {
+    training = &t;
+    added.clear();
+    order.resize(t.size());
+    for(size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+
+    // a node uses up at least one row
+    nodes.resize(std::max<size_t>(t.size(), 1));
+    num_nodes = 0;
+    build_node(allocate(), 0, order.size(), pool);
+    nodes.resize(num_nodes);
+
+    fprintf(stderr, "vp-tree built: %u nodes\n", num_nodes);
+  }
+
+  void build_node(unsigned id, size_t begin, size_t end, ThreadPool* pool)
+  {
+    Node& node = nodes[id];
+    node.begin = begin;
+    node.end = end;
+    node.radius = 0;
+    node.inside = node.outside = -1;
+
+    if(end - begin <= VP_LEAF_SIZE)
+      return;
+
+    // vantage row drawn by hashing the range, moved first
+    std::swap(order[begin], order[begin + mix64(begin * 31 + end) % (end - begin)]);
+    SparseRow vantage = training->row(order[begin]);
+
+    std::vector<std::pair<double, unsigned> > distances;
+    distances.reserve(end - begin - 1);
+    for(size_t i = begin + 1; i < end; ++i)
+      distances.push_back(std::make_pair(distance(vantage, training->row(order[i])), order[i]));
+
+    size_t median = distances.size() / 2;
+    std::nth_element(distances.begin(), distances.begin() + median, distances.end());
+    node.radius = distances[median].first;
+    for(size_t i = 0; i < distances.size(); ++i)
+      order[begin + 1 + i] = distances[i].second;
+
+    size_t mid = begin + 1 + median;
+    int inside = allocate();
+    int outside = allocate();
+    node.inside = inside;
+    node.outside = outside;
+
+    if(end - begin >= VP_PARALLEL_SIZE)
+      pool->parallel_for(2,
+                         [&](int i)
+                         {
+                           if(i == 0)
+                             build_node(inside, begin + 1, mid, pool);
+                           else
+                             build_node(outside, mid, end, pool);
+                         }
+                         );
+    else
+    {
+      build_node(inside, begin + 1, mid, pool);
+      build_node(outside, mid, end, pool);
+    }
+  }
+
+  void add(size_t r)
+  {
+    added.push_back(r);
+  }
+
+  // push the k nearest rows to query into topk, with their squared
+  // distance as the scan does
+  void search(const Query& query, TopK* topk) const
+  {
+    SparseRow q = query.row();
+    Stats s = {1, added.size(), 0};
+    for(const auto& r : added)
+      topk->push(kernels::euclidean(q, training->row(r)), r);
+
+    if(!nodes.empty() && !order.empty())
+      search_node(0, q, topk, &s);
+    knn::stats::count(knn::stats::EXAMPLES_SCANNED, s.visited);
+
+    lock_type lock(stats_mutex);
+    stats.queries += s.queries;
+    stats.visited += s.visited;
+    stats.pruned += s.pruned;
+  }
+
+  void search_node(unsigned id, const SparseRow& q, TopK* topk, Stats* s) const
+  {
+    // slack on the bound so that rounding never prunes a row that ties
+    static const double slack = 1e-6;
+    const Node& node = nodes[id];
+
+    if(node.inside < 0)
+    {
+      for(size_t i = node.begin; i < node.end; ++i)
+        topk->push(kernels::euclidean(q, training->row(order[i])), order[i]);
+      s->visited += node.end - node.begin;
+      return;
+    }
+
+    double d2 = kernels::euclidean(q, training->row(order[node.begin]));
+    topk->push(d2, order[node.begin]);
+    ++s->visited;
+
+    double d = std::sqrt(d2);
+    bool inside_first = d < node.radius;
+    int first = inside_first ? node.inside : node.outside;
+    int second = inside_first ? node.outside : node.inside;
+
+    search_node(first, q, topk, s);
+
+    double tau = std::sqrt(topk->bound()) + slack;
+    if(inside_first ? (d + tau >= node.radius) : (d - tau <= node.radius))
+      search_node(second, q, topk, s);
+    else
+      ++s->pruned;
+  }
+};
+
+}
@@ -0,0 +1,172 @@
+// synthetic examples in the input format, for the benchmarks
+// usage: bench_data [options] > file
+//
+// the features of an example are drawn from a Zipf law over the
+// vocabulary, rank r having a probability proportional to 1 / (r+1)^skew;
+// for a share of them (the signal) the rank is shifted by an offset
+// proper to the class of the example, so that its nearest neighbours
+// tend to share its class
+// values are small integer counts, as the noise filter expects
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include "Random.hh"
+
+#define ROWS 10000
+#define VOCABULARY 10000
+#define NNZ 20
+#define CLASSES 10
+#define SKEW 1.0
+#define SIGNAL 0.5
+#define SEED 1
+#define MAX_VALUE 4
+
+// feature names are truncated to 5 characters by the parser:
+// 'f' followed by 4 base 36 digits
+#define MAX_VOCABULARY (36 * 36 * 36 * 36)
+
+void print_help_message(char* program_name)
+{
+  fprintf(stderr, "%s usage: %s [options] > file\n", program_name, program_name);
+  fprintf(stderr, "OPTIONS :\n");
+  fprintf(stderr, "      --rows                 : nb of examples (default is %d)\n", ROWS);
+  fprintf(stderr, "      --vocabulary           : nb of distinct features, at most %d (default is %d)\n", MAX_VOCABULARY, VOCABULARY);
+  fprintf(stderr, "      --nnz                  : nb of features per example (default is %d)\n", NNZ);
+  fprintf(stderr, "      --classes              : nb of classes (default is %d)\n", CLASSES);
+  fprintf(stderr, "      --skew                 : exponent of the Zipf law of the features, 0 for uniform (default is %g)\n", SKEW);
+  fprintf(stderr, "      --signal               : share of the features shifted by class (default is %g)\n", SIGNAL);
+  fprintf(stderr, "      --seed                 : examples differ by seed, not the classes (default is %d)\n", SEED);
+  fprintf(stderr, "      -help,-h               : print this message\n");
+}
+
+// reproducible uniform draws in (0, 1]
+struct Draws
+{
+  uint64_t counter;
+
+  Draws(uint64_t seed) : counter(seed << 40) {};
+
+  double next() { return knn::uniform(knn::mix64(counter++)); }
+};
+
+std::string feature_name(unsigned id)
+{
+  static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+  std::string res = "f0000";
+  for(int i = 4; i > 0; --i, id /= 36)
+    res[i] = digits[id % 36];
+  return res;
+}
+
+int main(int argc, char** argv)
+{
+  long rows = ROWS;
+  long vocabulary = VOCABULARY;
+  long nnz = NNZ;
+  long classes = CLASSES;
+  double skew = SKEW;
+  double signal = SIGNAL;
+  long seed = SEED;
+
+  while(1) {
+
+    static struct option long_options[] =
+      {
+        {"help",       no_argument,       0, 'h'},
+        {"rows",       required_argument, 0, 'r'},
+        {"vocabulary", required_argument, 0, 'v'},
+        {"nnz",        required_argument, 0, 'n'},
+        {"classes",    required_argument, 0, 'c'},
+        {"skew",       required_argument, 0, 'z'},
+        {"signal",     required_argument, 0, 'S'},
+        {"seed",       required_argument, 0, 's'},
+        {0, 0, 0, 0}
+      };
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "h", long_options, &option_index);
+    if (c == -1)
+      break;
+
+    switch (c)
+      {
+      case 'h':
+        print_help_message(argv[0]);
+        exit(0);
+      case 'r':
+        rows = atol(optarg);
+        break;
+      case 'v':
+        vocabulary = atol(optarg);
+        break;
+      case 'n':
+        nnz = atol(optarg);
+        break;
+      case 'c':
+        classes = atol(optarg);
+        break;
+      case 'z':
+        skew = atof(optarg);
+        break;
+      case 'S':
+        signal = atof(optarg);
+        break;
+      case 's':
+        seed = atol(optarg);
+        break;
+      case '?':
+        break;
+      default:
+        abort();
+      }
+  }
+
+  if(rows < 0 || vocabulary <= 0 || vocabulary > MAX_VOCABULARY || nnz <= 0 || classes <= 0 ||
+     skew < 0 || signal < 0 || signal > 1) {
+    print_help_message(argv[0]);
+    return 1;
+  }
+  nnz = std::min(nnz, vocabulary);
+
+  // cumulative probabilities of the ranks
+  std::vector<double> cdf(vocabulary);
+  double total = 0;
+  for(long r = 0; r < vocabulary; ++r)
+    cdf[r] = total += std::pow(double(r + 1), -skew);
+  for(auto& p : cdf)
+    p /= total;
+
+  Draws draws(seed);
+  std::vector<unsigned> features;
+
+  for(long i = 0; i < rows; ++i)
+  {
+    long category = long(draws.next() * classes) % classes;
+    long offset = category * (vocabulary / classes);
+
+    // distinct features, a heavy skew may not leave nnz of them within reach
+    features.clear();
+    for(long attempt = 0; long(features.size()) < nnz && attempt < 50 * nnz; ++attempt)
+    {
+      long rank = std::lower_bound(cdf.begin(), cdf.end(), draws.next()) - cdf.begin();
+      rank = std::min(rank, vocabulary - 1);
+      unsigned id = draws.next() <= signal ? (rank + offset) % vocabulary : rank;
+      if(std::find(features.begin(), features.end(), id) == features.end())
+        features.push_back(id);
+    }
+
+    printf("ex%ld c%ld", i, category);
+    for(const auto& id : features)
+      printf(" %s:%d", feature_name(id).c_str(), 1 + int(draws.next() * MAX_VALUE) % MAX_VALUE);
+    printf("\n");
+  }
+
+  return 0;
+}
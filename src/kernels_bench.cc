@@ -0,0 +1,178 @@
+// microbenchmark of the distance kernels against the original merge loops
+// usage: kernels_bench [nnz [vocabulary [pairs]]]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <set>
+#include <chrono>
+#include <random>
+
+#include "Kernels.hh"
+
+// the loops of Example::compute_distance and Example::compute_similarity
+// as they were before the vector kernels
+double reference_distance(const knn::SparseRow& a, const knn::SparseRow& b)
+{
+  double distance = 0;
+  size_t i = 0, j = 0;
+
+  while(i < a.size && j < b.size) {
+    if(a.ids[i] < b.ids[j])
+    {
+      distance += a.values[i] * a.values[i];
+      ++i;
+    }
+    else if (b.ids[j] < a.ids[i])
+    {
+      distance += b.values[j] * b.values[j];
+      ++j;
+    }
+    else // equal
+    {
+      distance += (a.values[i] - b.values[j]) * (a.values[i] - b.values[j]);
+      ++i; ++j;
+    }
+  }
+
+  while(i < a.size) { distance += a.values[i] * a.values[i]; ++i; }
+  while(j < b.size) { distance += b.values[j] * b.values[j]; ++j; }
+
+  return distance;
+}
+
+double reference_similarity(const knn::SparseRow& a, const knn::SparseRow& b)
+{
+  double distance = 0, magthis = 0, magother = 0;
+  size_t i = 0, j = 0;
+
+  while(i < a.size && j < b.size) {
+    if(a.ids[i] < b.ids[j])
+    {
+      magthis += a.values[i] * a.values[i];
+      ++i;
+    }
+    else if (b.ids[j] < a.ids[i])
+    {
+      magother += b.values[j] * b.values[j];
+      ++j;
+    }
+    else // equal
+    {
+      distance += a.values[i] * b.values[j];
+      magthis += a.values[i] * a.values[i];
+      magother += b.values[j] * b.values[j];
+      ++i; ++j;
+    }
+  }
+
+  while(i < a.size) { magthis  += a.values[i] * a.values[i]; ++i; }
+  while(j < b.size) { magother += b.values[j] * b.values[j]; ++j; }
+
+  return 1 - distance / (std::sqrt(magthis) * std::sqrt(magother));
+}
+
+struct Rows
+{
+  std::vector<unsigned> ids;
+  std::vector<double> values;
+  std::vector<size_t> offsets;
+  std::vector<double> squared_norms;
+
+  knn::SparseRow row(size_t i) const
+  {
+    knn::SparseRow r = { &ids[offsets[i]], &values[offsets[i]], offsets[i + 1] - offsets[i],
+                         squared_norms[i] };
+    return r;
+  }
+};
+
+Rows generate(size_t rows, size_t nnz, unsigned vocabulary, std::mt19937& gen)
+{
+  Rows res;
+  res.offsets.push_back(0);
+  std::uniform_int_distribution<unsigned> feature(0, vocabulary - 1);
+  std::normal_distribution<double> value;
+
+  for(size_t r = 0; r < rows; ++r)
+  {
+    std::set<unsigned> ids;
+    while(ids.size() < nnz)
+      ids.insert(feature(gen));
+    for(const auto& id : ids)
+    {
+      res.ids.push_back(id);
+      res.values.push_back(value(gen));
+    }
+    res.offsets.push_back(res.ids.size());
+    res.squared_norms.push_back(knn::kernels::squared_norm(&res.values[res.offsets[r]], nnz));
+  }
+  return res;
+}
+
+template<class F>
+double time_pairs(const Rows& a, const Rows& b, size_t pairs, F f, double* checksum)
+{
+  size_t rows = a.offsets.size() - 1;
+  double sum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for(size_t p = 0; p < pairs; ++p)
+    sum += f(a.row(p % rows), b.row((p * 7) % rows));
+  auto end = std::chrono::steady_clock::now();
+
+  *checksum = sum;
+  return std::chrono::duration<double, std::nano>(end - start).count() / pairs;
+}
+
+int main(int argc, char** argv)
+{
+  size_t nnz = argc > 1 ? atoi(argv[1]) : 50;
+  unsigned vocabulary = argc > 2 ? atoi(argv[2]) : 1000;
+  size_t pairs = argc > 3 ? atoi(argv[3]) : 2000000;
+  size_t rows = 1024;
+
+  std::mt19937 gen(42);
+  Rows a = generate(rows, nnz, vocabulary, gen);
+  Rows b = generate(rows, nnz, vocabulary, gen);
+
+  fprintf(stdout, "nnz: %lu\tvocabulary: %u\tpairs: %lu\n", nnz, vocabulary, pairs);
+
+  double checksum;
+  double t = time_pairs(a, b, pairs, reference_distance, &checksum);
+  fprintf(stdout, "%-10s euclidean %8.2f ns/pair\n", "reference", t);
+  t = time_pairs(a, b, pairs, reference_similarity, &checksum);
+  fprintf(stdout, "%-10s cosine    %8.2f ns/pair\n", "reference", t);
+
+  int errors = 0;
+
+  for(const auto& k : knn::kernels::available_dots())
+  {
+    knn::kernels::dot = k.second;
+
+    // agreement with the reference loops
+    double max_error = 0;
+    for(size_t i = 0; i < rows; ++i)
+      for(size_t j = 0; j < rows; j += 17)
+      {
+        max_error = std::max(max_error, std::fabs(knn::kernels::euclidean(a.row(i), b.row(j))
+                                                  - reference_distance(a.row(i), b.row(j))));
+        max_error = std::max(max_error, std::fabs(knn::kernels::cosine(a.row(i), b.row(j))
+                                                  - reference_similarity(a.row(i), b.row(j))));
+      }
+
+    t = time_pairs(a, b, pairs, knn::kernels::euclidean, &checksum);
+    fprintf(stdout, "%-10s euclidean %8.2f ns/pair\n", k.first.c_str(), t);
+    t = time_pairs(a, b, pairs, knn::kernels::cosine, &checksum);
+    fprintf(stdout, "%-10s cosine    %8.2f ns/pair\tmax error: %g\n", k.first.c_str(), t, max_error);
+
+    if(max_error > 1e-9)
+    {
+      fprintf(stderr, "ERROR: kernel %s disagrees with the reference loops\n", k.first.c_str());
+      ++errors;
+    }
+  }
+
+  return errors ? 1 : 0;
+}
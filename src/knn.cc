@@ -1,13 +1,20 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <sstream>
 #include "Predictor.hh"
+#include "Server.hh"
+#include "Shard.hh"
 
 #include <getopt.h>
+#include <sys/stat.h>
 
 #define NUM_THREADS 1
 #define NUM_NEIGHBOURS 10
 #define DISTANCE "cosine"
+#define INDEX "none"
+#define BATCH 1
+#define PRECISION "double"
 
 
 
@@ -16,21 +23,134 @@ void  print_help_message(char *program_name)
 fprintf(stderr, "%s usage: %s [options] < file\n", program_name, program_name);
  fprintf(stderr, "OPTIONS :\n");
  fprintf(stderr, "      --train,-t             : example file\n");
+ fprintf(stderr, "      --model,-m             : binary model file to load instead of an example file\n");
+ fprintf(stderr, "      --save-model,-s        : save the loaded examples to a binary model file\n");
  fprintf(stderr, "      --threads,-j           : nb of threads (default is %d)\n", NUM_THREADS);
  fprintf(stderr, "      --k,-k                 : nb of neighbours (default is %d)\n", NUM_NEIGHBOURS);
  fprintf(stderr, "      --distance,-d          : type of distance euclidean or cosine (default is %s)\n", DISTANCE);
- fprintf(stderr, "      --eval,-e              : evaluation mode\n");
+ fprintf(stderr, "      --index,-i             : search index none, inverted (cosine only), lsh (cosine only), hnsw, ivf or vptree (euclidean only) (default is %s)\n", INDEX);
+ fprintf(stderr, "      --lsh-tables           : nb of hash tables of the lsh index (default is %d)\n", LSH_TABLES);
+ fprintf(stderr, "      --lsh-bits             : nb of bits per lsh hash table, at most 64 (default is %d)\n", LSH_BITS);
+ fprintf(stderr, "      --lsh-probes           : nb of buckets one bit away also searched per lsh hash table (default is %d)\n", LSH_PROBES);
+ fprintf(stderr, "      --hnsw-m               : nb of links per hnsw node (default is %d)\n", HNSW_M);
+ fprintf(stderr, "      --ef-construction      : nb of candidates kept while building the hnsw graph (default is %d)\n", EF_CONSTRUCTION);
+ fprintf(stderr, "      --ef-search            : nb of candidates kept while searching the hnsw graph (default is %d)\n", EF_SEARCH);
+ fprintf(stderr, "      --ivf-lists            : nb of ivf lists, 0 for the square root of the nb of examples (default is %d)\n", IVF_LISTS);
+ fprintf(stderr, "      --nprobe               : nb of ivf lists scanned per query (default is %d)\n", NPROBE);
+ fprintf(stderr, "      --batch,-b             : nb of queries read and processed together (default is %d)\n", BATCH);
+ fprintf(stderr, "      --precision            : storage of the training values scanned double, float or int8 (default is %s)\n", PRECISION);
+ fprintf(stderr, "      --rescore              : rank the candidates of a float or int8 scan again on the exact values\n");
+ fprintf(stderr, "      --early-stop           : abandon a training example once its partial distance exceeds the k-th best (euclidean and double precision only)\n");
+ fprintf(stderr, "      --reorder-features     : with --early-stop, walk the features of each example by decreasing magnitude\n");
+ fprintf(stderr, "      --numa                 : split the training examples between the numa nodes, each scanned by threads pinned to its cpus\n");
+ fprintf(stderr, "                               (exact search at double precision only)\n");
+ fprintf(stderr, "      --kernel               : dot product kernel (default is the fastest supported):");
+ for(const auto& k : knn::kernels::available_dots())
+   fprintf(stderr, " %s", k.first.c_str());
+ fprintf(stderr, "\n");
+ fprintf(stderr, "      --serve                : answer the clients of a unix domain socket at this path instead of reading stdin\n");
+ fprintf(stderr, "                               (on stdin or the socket, a line '+ example' adds a training example, '- id' removes those with that id)\n");
+ fprintf(stderr, "      --shard                : i/n, with --train and --serve, hold the i-th of n parts of the training file for a coordinator\n");
+ fprintf(stderr, "      --shards               : comma separated sockets of the n shards, in order, to answer the queries with instead of a training file\n");
+ fprintf(stderr, "                               (a --train file given is checked to be the one the shards hold)\n");
+ fprintf(stderr, "      --knn-graph            : write the k nearest neighbours of every training example to this file instead of reading stdin\n");
+ fprintf(stderr, "      --stats                : time the stages of loading and querying, reported as JSON on stderr at the end\n");
+ fprintf(stderr, "                               (or to a socket client writing a line '?')\n");
+ fprintf(stderr, "      --eval,-e              : evaluation mode, with the recall of the index against an exact search\n");
+ fprintf(stderr, "      --sweep                : evaluation mode, with the accuracy for every k up to --k from the same neighbours\n");
+ fprintf(stderr, "      --leave-one-out        : evaluation mode on the training examples, each classified by the others, instead of reading stdin\n");
  fprintf(stderr, "      -help,-h               : print this message\n");
 }
 
 
+// answer the queries of stdin with the neighbours found by shards, as
+// main does with a predictor of its own; stops at the first failed search
+int coordinate(const knn::Coordinator<knn::ZNormaliser>& coordinator, int batch, bool eval)
+{
+  char* buffer = NULL;
+  size_t buffer_length = 0;
+  ssize_t length = 0;
+
+  int total = 0;
+  int correct = 0;
+
+  std::vector<knn::Example> examples;
+  examples.reserve(batch);
+
+  auto process_batch = [&]()
+  {
+    std::vector<std::string> hyps = coordinator.predict(examples);
+    if(hyps.size() != examples.size())
+      return false;
+    for(size_t i = 0; i < examples.size(); ++i)
+    {
+      fprintf(stdout, "%s %s\n", examples[i].id.c_str(), hyps[i].c_str());
+      ++total;
+      if(eval)
+      {
+        if(examples[i].category == hyps[i])
+          ++correct;
+        fprintf(stderr, "correct: %d\ttotal: %d\taccuracy: %f\n", correct, total, double(correct)/total);
+      }
+    }
+    examples.clear();
+    return true;
+  };
+
+  std::string reply;
+  bool ok = true;
+  while(ok && 0 <= (length = read_line(&buffer, &buffer_length, stdin))) {
+    if(coordinator.is_update(buffer, buffer + length)) {
+      if(!examples.empty() && !(ok = process_batch()))
+        break;
+      coordinator.update(buffer, buffer + length, &reply);
+      fprintf(stdout, "%s\n", reply.c_str());
+      continue;
+    }
+
+    examples.emplace_back();
+    coordinator.load_query(buffer, buffer + length, &examples.back());
+
+    if(examples.size() == (unsigned) batch)
+      ok = process_batch();
+  }
+  if(ok && !examples.empty())
+    ok = process_batch();
+  free(buffer);
+
+  if(!ok) {
+    fprintf(stderr, "ERROR: the shards failed, queries left unanswered\n");
+    return 1;
+  }
+
+  if(eval)
+    fprintf(stderr, "correct: %d\ttotal: %d\taccuracy: %f\n", correct, total, double(correct)/total);
+
+  if(knn::stats::enabled)
+    fprintf(stderr, "%s\n", knn::stats::report().c_str());
+
+  return 0;
+}
+
 int main(int argc, char** argv) {
   char * train = NULL;
+  char * model = NULL;
+  char * save_model = NULL;
+  char * serve = NULL;
+  char * knn_graph = NULL;
+  char * shard = NULL;
+  char * shards = NULL;
   int threads = NUM_THREADS;
   int k = NUM_NEIGHBOURS;
+  int batch = BATCH;
   bool eval = false;
+  bool sweep = false;
+  bool leave_one_out = false;
 
   std::string distance = DISTANCE;
+  std::string index = INDEX;
+  std::string precision = PRECISION;
+  knn::SearchOptions search_options;
 
   // read the commandline
   int c;
@@ -43,16 +163,41 @@ int main(int argc, char** argv) {
         {"help",     no_argument,             0, 'h'},
         {"eval",     no_argument,             0, 'e'},
         {"train",    required_argument,       0, 't'},
+        {"model",    required_argument,       0, 'm'},
+        {"save-model", required_argument,     0, 's'},
         {"k",        required_argument,       0, 'k'},
         {"threads",  required_argument,       0, 'j'},
         {"distance", required_argument,       0, 'd'},
+        {"index",    required_argument,       0, 'i'},
+        {"batch",    required_argument,       0, 'b'},
+        {"kernel",   required_argument,       0, 'K'},
+        {"lsh-tables", required_argument,     0, 'T'},
+        {"lsh-bits", required_argument,       0, 'B'},
+        {"lsh-probes", required_argument,     0, 'Q'},
+        {"hnsw-m",   required_argument,       0, 'M'},
+        {"ef-construction", required_argument, 0, 'C'},
+        {"ef-search", required_argument,      0, 'S'},
+        {"ivf-lists", required_argument,      0, 'I'},
+        {"nprobe",   required_argument,       0, 'P'},
+        {"precision", required_argument,      0, 'R'},
+        {"rescore",  no_argument,             0, 'r'},
+        {"early-stop", no_argument,           0, 'E'},
+        {"reorder-features", no_argument,     0, 'O'},
+        {"numa",     no_argument,             0, 'N'},
+        {"serve",    required_argument,       0, 'U'},
+        {"stats",    no_argument,             0, 'X'},
+        {"knn-graph", required_argument,      0, 'G'},
+        {"shard",    required_argument,       0, 'H'},
+        {"shards",   required_argument,       0, 'A'},
+        {"sweep",    no_argument,             0, 'W'},
+        {"leave-one-out", no_argument,        0, 'L'},
         {0, 0, 0, 0}
       };
 
     // int to store arg position
     int option_index = 0;
 
-    c = getopt_long (argc, argv, "j:t:k:hed:", long_options, &option_index);
+    c = getopt_long (argc, argv, "j:t:k:hed:i:b:m:s:", long_options, &option_index);
 
     // Detect the end of the options
     if (c == -1)
@@ -84,6 +229,16 @@ int main(int argc, char** argv) {
         train = optarg;
         break;
 
+      case 'm':
+        fprintf (stderr, "model filename: %s\n", optarg);
+        model = optarg;
+        break;
+
+      case 's':
+        fprintf (stderr, "save model to: %s\n", optarg);
+        save_model = optarg;
+        break;
+
       case 'k':
         fprintf (stderr, "number of neighbours to consider: %s\n", optarg);
         k = atoi(optarg);
@@ -99,6 +254,121 @@ int main(int argc, char** argv) {
         fprintf(stderr, "distance: %s\n", optarg);
         distance = optarg;
         break;
+
+      case 'i':
+        fprintf(stderr, "index: %s\n", optarg);
+        index = optarg;
+        break;
+
+      case 'b':
+        fprintf(stderr, "batch size: %s\n", optarg);
+        batch = atoi(optarg);
+        break;
+
+      case 'K':
+        fprintf(stderr, "kernel: %s\n", optarg);
+        if(!knn::kernels::available_dots().count(optarg)) {
+          fprintf(stderr, "ERROR: kernel %s is not supported\n", optarg);
+          return 1;
+        }
+        knn::kernels::dot = knn::kernels::available_dots()[optarg];
+        break;
+
+      case 'T':
+        fprintf(stderr, "lsh tables: %s\n", optarg);
+        search_options.lsh_tables = atoi(optarg);
+        break;
+
+      case 'B':
+        fprintf(stderr, "lsh bits: %s\n", optarg);
+        search_options.lsh_bits = atoi(optarg);
+        break;
+
+      case 'Q':
+        fprintf(stderr, "lsh probes: %s\n", optarg);
+        search_options.lsh_probes = atoi(optarg);
+        break;
+
+      case 'M':
+        fprintf(stderr, "hnsw links per node: %s\n", optarg);
+        search_options.hnsw_m = atoi(optarg);
+        break;
+
+      case 'C':
+        fprintf(stderr, "hnsw ef construction: %s\n", optarg);
+        search_options.ef_construction = atoi(optarg);
+        break;
+
+      case 'S':
+        fprintf(stderr, "hnsw ef search: %s\n", optarg);
+        search_options.ef_search = atoi(optarg);
+        break;
+
+      case 'I':
+        fprintf(stderr, "ivf lists: %s\n", optarg);
+        search_options.ivf_lists = atoi(optarg);
+        break;
+
+      case 'P':
+        fprintf(stderr, "ivf probes: %s\n", optarg);
+        search_options.nprobe = atoi(optarg);
+        break;
+
+      case 'R':
+        fprintf(stderr, "precision: %s\n", optarg);
+        precision = optarg;
+        break;
+
+      case 'r':
+        search_options.rescore = true;
+        break;
+
+      case 'E':
+        search_options.early_stop = true;
+        break;
+
+      case 'O':
+        search_options.reorder_features = true;
+        break;
+
+      case 'N':
+        search_options.numa = true;
+        break;
+
+      case 'U':
+        fprintf(stderr, "serve on socket: %s\n", optarg);
+        serve = optarg;
+        break;
+
+      case 'G':
+        fprintf(stderr, "knn graph: %s\n", optarg);
+        knn_graph = optarg;
+        break;
+
+      case 'H':
+        fprintf(stderr, "shard: %s\n", optarg);
+        shard = optarg;
+        break;
+
+      case 'A':
+        fprintf(stderr, "shards: %s\n", optarg);
+        shards = optarg;
+        break;
+
+      case 'X':
+        knn::stats::enabled = true;
+        break;
+
+      case 'W':
+        sweep = true;
+        eval = true;
+        break;
+
+      case 'L':
+        leave_one_out = true;
+        eval = true;
+        break;
+
       case '?':
         // getopt_long already printed an error message.
         break;
@@ -109,16 +379,125 @@ int main(int argc, char** argv) {
 
   }
 
-  if(train == NULL || threads <= 0 || k < 0) {
+  if((!shards && (train == NULL) == (model == NULL)) || threads <= 0 || k < 0 || batch <= 0 ||
+     !knn::string2dt.count(distance) || !knn::string2it.count(index) ||
+     !knn::string2precision.count(precision) ||
+     search_options.lsh_tables == 0 || search_options.lsh_bits == 0 || search_options.lsh_bits > 64 ||
+     search_options.hnsw_m < 2 || search_options.ef_construction == 0 || search_options.nprobe == 0) {
     print_help_message(argv[0]);
     return 1;
   }
 
+  if((knn::string2it.at(index) == knn::INVERTED || knn::string2it.at(index) == knn::LSH) &&
+     knn::string2dt.at(distance) != knn::COSINE) {
+    fprintf(stderr, "ERROR: the %s index requires the cosine distance\n", index.c_str());
+    return 1;
+  }
+
+  if(search_options.early_stop && knn::string2dt.at(distance) != knn::EUCLIDEAN) {
+    fprintf(stderr, "ERROR: --early-stop requires the euclidean distance\n");
+    return 1;
+  }
+
+  if(search_options.early_stop && knn::string2precision.at(precision) != knn::FLOAT64) {
+    fprintf(stderr, "ERROR: --early-stop computes partial distances on the double values, it requires --precision double\n");
+    return 1;
+  }
+
+  if(search_options.numa && (knn::string2it.at(index) != knn::BRUTE_FORCE ||
+                             knn::string2precision.at(precision) != knn::FLOAT64 || search_options.early_stop)) {
+    fprintf(stderr, "ERROR: --numa splits the exact scan, it requires --index none, --precision double and no --early-stop\n");
+    return 1;
+  }
+
+  if(search_options.numa && (save_model || knn_graph)) {
+    fprintf(stderr, "ERROR: --numa keeps the examples on the numa nodes, it cannot be used with --save-model or --knn-graph\n");
+    return 1;
+  }
+
+  if(knn::string2it.at(index) == knn::VP_TREE && knn::string2dt.at(distance) != knn::EUCLIDEAN) {
+    fprintf(stderr, "ERROR: the %s index requires the euclidean distance\n", index.c_str());
+    return 1;
+  }
+
+  if(leave_one_out && serve) {
+    fprintf(stderr, "ERROR: --leave-one-out reads no queries, it cannot be used with --serve\n");
+    return 1;
+  }
+
+  if(knn_graph && (serve || leave_one_out)) {
+    fprintf(stderr, "ERROR: --knn-graph reads no queries, it cannot be used with --serve or --leave-one-out\n");
+    return 1;
+  }
+
+  unsigned part = 0, parts = 0;
+  if(shard && (sscanf(shard, "%u/%u", &part, &parts) != 2 || part >= parts || !train || !serve ||
+               save_model || knn_graph || leave_one_out)) {
+    fprintf(stderr, "ERROR: --shard takes i/n with i < n, a --train file and a --serve socket, and no other mode\n");
+    return 1;
+  }
+
+  if(shards && (shard || model || knn_graph || leave_one_out || sweep)) {
+    fprintf(stderr, "ERROR: --shards cannot be used with --shard, --model, --knn-graph, --leave-one-out or --sweep\n");
+    return 1;
+  }
+
+  struct stat st;
+  if(shards && train && stat(train, &st) != 0) {
+    fprintf(stderr, "ERROR: cannot find the training file \"%s\"\n", train);
+    return 1;
+  }
+
+  if(shards)
+  {
+    std::vector<std::string> paths;
+    std::stringstream list(shards);
+    for(std::string p; std::getline(list, p, ',');)
+      paths.push_back(p);
+
+    knn::Coordinator<knn::ZNormaliser>
+        coordinator(paths, k, knn::string2dt.at(distance), knn::string2it.at(index),
+                    knn::string2precision.at(precision), train ? train : "");
+    if(!coordinator.start())
+      return 1;
+
+    if(serve)
+    {
+      knn::Server<knn::Coordinator<knn::ZNormaliser> > server(coordinator, serve, batch);
+      return server.serve() ? 0 : 1;
+    }
+    return coordinate(coordinator, batch, eval);
+  }
+
+  search_options.precision = knn::string2precision.at(precision);
+
+  if(shard)
+  {
+    knn::Predictor<knn::ZNormaliser>
+        predictor(threads, k, knn::string2dt.at(distance), knn::string2it.at(index), search_options);
+    knn::Shard<knn::Predictor<knn::ZNormaliser> > server(predictor, train, serve, part, parts);
+    return server.serve() ? 0 : 1;
+  }
+
+  // with leave-one-out, the example itself is among the k + 1 nearest and left out
   knn::Predictor<knn::ZNormaliser>
-      predictor(threads, train, k, knn::string2dt.at(distance));
+      predictor(threads, model ? model : train, leave_one_out ? k + 1 : k,
+                knn::string2dt.at(distance), knn::string2it.at(index), model != NULL, search_options);
+
+  if(save_model && !predictor.save_model(save_model))
+    return 1;
 
   fprintf(stderr, "\n\nTraining examples loaded\n\n");
 
+  if(knn_graph)
+    return predictor.write_knn_graph(knn_graph) ? 0 : 1;
+
+  if(serve)
+  {
+    knn::Server<knn::Predictor<knn::ZNormaliser> > server(predictor, serve, batch);
+    return server.serve() ? 0 : 1;
+  }
+
 
   char* buffer = NULL;
   size_t buffer_length = 0;
@@ -126,31 +505,111 @@ int main(int argc, char** argv) {
 
   int total = 0;
   int correct = 0;
+  size_t found = 0;
+  size_t expected = 0;
+  std::vector<int> sweep_correct(k, 0);  // by k - 1
+
+  std::vector<knn::Example> examples;
+  examples.reserve(batch);
+
+  auto process_batch = [&]()
+  {
+    std::vector<std::vector<knn::Neighbour> > neighbours = predictor.neighbours(examples);
+
+    // with leave-one-out, examples[i] is training row total + i
+    if(leave_one_out)
+      for(size_t i = 0; i < examples.size(); ++i)
+        knn::exclude(&neighbours[i], total + i, k);
+
+    // recall of the index: the share of the exact neighbours it found
+    if(eval && predictor.it != knn::BRUTE_FORCE)
+    {
+      std::vector<std::vector<knn::Neighbour> > exact = predictor.exact_neighbours(examples);
+      for(size_t i = 0; i < examples.size(); ++i)
+      {
+        if(leave_one_out)
+          knn::exclude(&exact[i], total + i, k);
+        found += knn::common(exact[i], neighbours[i]);
+        expected += exact[i].size();
+      }
+    }
 
-  while(0 <= (length = read_line(&buffer, &buffer_length, stdin))) {
+    for(size_t i = 0; i < examples.size(); ++i)
+    {
+      std::string hyp = predictor.vote(neighbours[i]);
+      fprintf(stdout, "%s %s\n", examples[i].id.c_str(), hyp.c_str());
 
-    //    fprintf(stderr, "example: %d", total);
+      // the votes of every smaller k, from the same neighbours
+      if(sweep)
+      {
+        std::vector<std::string> votes = predictor.sweep_votes(neighbours[i]);
+        for(size_t j = 0; j < votes.size(); ++j)
+          if(votes[j] == examples[i].category)
+            ++sweep_correct[j];
+      }
+      ++total;
+      if(eval)
+      {
+        if(examples[i].category == hyp)
+          ++correct;
+        fprintf(stderr, "correct: %d\ttotal: %d\taccuracy: %f\n", correct, total, double(correct)/total);
+      }
+    }
 
-    knn::Example example(buffer, true, false);
-    //knn::Example example(buffer, false, false);
-    example.remove_noise(0.0001);
-    predictor.normaliser.normalise(&example);
+    examples.clear();
+  };
 
-    std::string ref_example = example.category;
-    std::string hyp_example = predictor.predict(example);
-    fprintf(stdout, "%s %s\n", example.id.c_str(), hyp_example.c_str());
-    ++total;
-    if(eval)
+  // the training rows are classified in batches, as queries are
+  if(leave_one_out)
+  {
+    for(size_t r = 0; r < predictor.training.size(); ++r)
     {
-      if(ref_example == hyp_example)
-        ++correct;
-      fprintf(stderr, "correct: %d\ttotal: %d\taccuracy: %f\n", correct, total, double(correct)/total);
+      examples.push_back(predictor.example(r));
+      if(examples.size() == (unsigned) batch)
+        process_batch();
     }
   }
+
+  std::string reply;
+  while(!leave_one_out && 0 <= (length = read_line(&buffer, &buffer_length, stdin))) {
+
+    // an update applies to the queries after it only
+    if(predictor.is_update(buffer, buffer + length)) {
+      if(!examples.empty())
+        process_batch();
+      predictor.update(buffer, buffer + length, &reply);
+      fprintf(stdout, "%s\n", reply.c_str());
+      continue;
+    }
+
+    examples.emplace_back();
+    predictor.load_query(buffer, buffer + length, &examples.back());
+
+    if(examples.size() == (unsigned) batch)
+      process_batch();
+  }
+  if(!examples.empty())
+    process_batch();
+
   if(eval)
   {
     fprintf(stderr, "correct: %d\ttotal: %d\taccuracy: %f\n", correct, total, double(correct)/total);
+    if(predictor.it != knn::BRUTE_FORCE)
+      fprintf(stderr, "recall: %f\n", expected ? double(found)/expected : 1.0);
+
+    if(sweep)
+      for(int i = 0; i < k; ++i)
+        fprintf(stderr, "k: %d\tcorrect: %d\ttotal: %d\taccuracy: %f\n",
+                i + 1, sweep_correct[i], total, total ? double(sweep_correct[i])/total : 0.0);
+
+    const knn::VpTree::Stats& s = predictor.vp_tree.stats;
+    if(predictor.it == knn::VP_TREE && s.queries)
+      fprintf(stderr, "vp-tree: %lu queries, per query %.1f rows visited out of %lu, %.1f subtrees pruned\n",
+              s.queries, double(s.visited)/s.queries, predictor.training.size(), double(s.pruned)/s.queries);
   }
 
+  if(knn::stats::enabled)
+    fprintf(stderr, "%s\n", knn::stats::report().c_str());
+
   return 0;
 }
@@ -0,0 +1,300 @@
+// benchmarks of the classifier on a training and a test file (see
+// bench_data): loading, normaliser fitting, distance kernels and predict
+// latency and throughput, for each number of threads given
+// usage: knn_bench --train file --test file [options] > results
+// results are written one JSON object per line, progress goes to stderr
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "Predictor.hh"
+
+#define THREADS "1"
+#define NUM_NEIGHBOURS 10
+#define DISTANCE "cosine"
+#define INDEX "none"
+#define BATCH 100
+
+// a measure is repeated until it has run that long
+#define MIN_SECONDS 0.2
+
+typedef knn::Predictor<knn::ZNormaliser> predictor_type;
+
+void print_help_message(char* program_name)
+{
+  fprintf(stderr, "%s usage: %s --train file --test file [options] > results\n", program_name, program_name);
+  fprintf(stderr, "OPTIONS :\n");
+  fprintf(stderr, "      --train,-t             : example file\n");
+  fprintf(stderr, "      --test,-q              : query file\n");
+  fprintf(stderr, "      --threads,-j           : comma separated nb of threads (default is %s)\n", THREADS);
+  fprintf(stderr, "      --k,-k                 : nb of neighbours (default is %d)\n", NUM_NEIGHBOURS);
+  fprintf(stderr, "      --distance,-d          : type of distance euclidean or cosine (default is %s)\n", DISTANCE);
+  fprintf(stderr, "      --index,-i             : search index, as for knn (default is %s)\n", INDEX);
+  fprintf(stderr, "      --batch,-b             : nb of queries per batch for the batch throughput (default is %d)\n", BATCH);
+  fprintf(stderr, "      -help,-h               : print this message\n");
+}
+
+double seconds_since(const std::chrono::steady_clock::time_point& start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string json_string(const std::string& s)
+{
+  std::string res = "\"";
+  for(const auto& c : s)
+  {
+    if(c == '"' || c == '\\')
+      res += '\\';
+    res += c;
+  }
+  return res + "\"";
+}
+
+// the p-th percentile of sorted values
+double percentile(const std::vector<double>& sorted, double p)
+{
+  if(sorted.empty())
+    return 0;
+  size_t i = std::min(sorted.size() - 1, size_t(p / 100 * sorted.size()));
+  return sorted[i];
+}
+
+// the global dictionary is filled by each load
+void reset_dictionary()
+{
+  string_map.clear();
+  count_map.clear();
+  counter = 0;
+  count_map_counter = 0;
+}
+
+std::string kernel_name(knn::kernels::dot_kernel dot)
+{
+  for(const auto& k : knn::kernels::available_dots())
+    if(k.second == dot)
+      return k.first;
+  return "unknown";
+}
+
+std::vector<knn::Example> load_queries(const predictor_type& predictor, const char* filename)
+{
+  std::vector<knn::Example> res;
+  FILE* fp = fopen(filename, "r");
+  if(!fp)
+    return res;
+
+  char* buffer = NULL;
+  size_t buffer_length = 0;
+  int length;
+  while(0 <= (length = read_line(&buffer, &buffer_length, fp)))
+  {
+    res.emplace_back();
+    predictor.load_query(buffer, buffer + length, &res.back());
+  }
+  free(buffer);
+  fclose(fp);
+  return res;
+}
+
+template<class Normaliser>
+void bench_normaliser(const knn::TrainingSet& training)
+{
+  size_t repeats = 0;
+  auto start = std::chrono::steady_clock::now();
+  do
+  {
+    Normaliser n;
+    n.init(training);
+    ++repeats;
+  }
+  while(seconds_since(start) < MIN_SECONDS);
+  double seconds = seconds_since(start) / repeats;
+
+  printf("{\"benchmark\": \"normaliser\", \"normaliser\": \"%s\", \"rows\": %lu, \"values\": %lu, "
+         "\"seconds\": %g, \"rows_per_second\": %g}\n",
+         Normaliser::name(), training.size(), training.values.size(), seconds, training.size() / seconds);
+}
+
+void bench_kernels(const knn::TrainingSet& training)
+{
+  size_t rows = training.size();
+  if(rows < 2)
+    return;
+
+  knn::kernels::dot_kernel selected = knn::kernels::dot;
+  for(const auto& k : knn::kernels::available_dots())
+  {
+    knn::kernels::dot = k.second;
+    for(int cosine = 0; cosine < 2; ++cosine)
+    {
+      knn::kernels::distance_function f = cosine ? knn::kernels::cosine : knn::kernels::euclidean;
+      size_t pairs = 0;
+      double checksum = 0;
+      auto start = std::chrono::steady_clock::now();
+      do
+      {
+        for(size_t i = 0; i < 100000; ++i, ++pairs)
+          checksum += f(training.row(pairs % rows), training.row((pairs * 7 + 1) % rows));
+      }
+      while(seconds_since(start) < MIN_SECONDS);
+      double seconds = seconds_since(start);
+
+      printf("{\"benchmark\": \"kernel\", \"kernel\": \"%s\", \"distance\": \"%s\", \"pairs\": %lu, "
+             "\"nanoseconds_per_pair\": %g, \"checksum\": %g}\n",
+             k.first.c_str(), cosine ? "cosine" : "euclidean", pairs, seconds * 1e9 / pairs, checksum);
+    }
+  }
+  knn::kernels::dot = selected;
+}
+
+// latency of each batch of queries
+void bench_predict(const predictor_type& predictor, const std::vector<knn::Example>& queries,
+                   int threads, size_t batch)
+{
+  if(queries.empty())
+    return;
+
+  std::vector<double> latencies;
+  std::vector<knn::Example> block;
+  auto start = std::chrono::steady_clock::now();
+  for(size_t q = 0; q < queries.size(); q += batch)
+  {
+    block.assign(queries.begin() + q, queries.begin() + std::min(queries.size(), q + batch));
+    auto query_start = std::chrono::steady_clock::now();
+    predictor.predict(block);
+    latencies.push_back(seconds_since(query_start) * 1000);
+  }
+  double seconds = seconds_since(start);
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("{\"benchmark\": \"predict\", \"threads\": %d, \"batch\": %lu, \"queries\": %lu, "
+         "\"p50_ms\": %g, \"p99_ms\": %g, \"max_ms\": %g, \"queries_per_second\": %g}\n",
+         threads, batch, queries.size(), percentile(latencies, 50), percentile(latencies, 99),
+         latencies.back(), queries.size() / seconds);
+  fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+  char* train = NULL;
+  char* test = NULL;
+  std::string threads_list = THREADS;
+  int k = NUM_NEIGHBOURS;
+  int batch = BATCH;
+  std::string distance = DISTANCE;
+  std::string index = INDEX;
+
+  while(1) {
+
+    static struct option long_options[] =
+      {
+        {"help",     no_argument,       0, 'h'},
+        {"train",    required_argument, 0, 't'},
+        {"test",     required_argument, 0, 'q'},
+        {"threads",  required_argument, 0, 'j'},
+        {"k",        required_argument, 0, 'k'},
+        {"distance", required_argument, 0, 'd'},
+        {"index",    required_argument, 0, 'i'},
+        {"batch",    required_argument, 0, 'b'},
+        {0, 0, 0, 0}
+      };
+
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "ht:q:j:k:d:i:b:", long_options, &option_index);
+    if (c == -1)
+      break;
+
+    switch (c)
+      {
+      case 'h':
+        print_help_message(argv[0]);
+        exit(0);
+      case 't':
+        train = optarg;
+        break;
+      case 'q':
+        test = optarg;
+        break;
+      case 'j':
+        threads_list = optarg;
+        break;
+      case 'k':
+        k = atoi(optarg);
+        break;
+      case 'd':
+        distance = optarg;
+        break;
+      case 'i':
+        index = optarg;
+        break;
+      case 'b':
+        batch = atoi(optarg);
+        break;
+      case '?':
+        break;
+      default:
+        abort();
+      }
+  }
+
+  std::vector<int> threads;
+  std::stringstream list(threads_list);
+  for(std::string t; std::getline(list, t, ',');)
+    threads.push_back(atoi(t.c_str()));
+
+  struct stat st;
+  if(train == NULL || test == NULL || stat(train, &st) != 0 || k <= 0 || batch <= 0 || threads.empty() ||
+     *std::min_element(threads.begin(), threads.end()) <= 0 ||
+     !knn::string2dt.count(distance) || !knn::string2it.count(index)) {
+    print_help_message(argv[0]);
+    return 1;
+  }
+  if(knn::string2it.at(index) == knn::VP_TREE && knn::string2dt.at(distance) != knn::EUCLIDEAN) {
+    fprintf(stderr, "ERROR: the %s index requires the euclidean distance\n", index.c_str());
+    return 1;
+  }
+
+  printf("{\"benchmark\": \"config\", \"train\": %s, \"test\": %s, \"k\": %d, \"distance\": \"%s\", "
+         "\"index\": \"%s\", \"kernel\": \"%s\"}\n",
+         json_string(train).c_str(), json_string(test).c_str(), k, distance.c_str(), index.c_str(),
+         kernel_name(knn::kernels::dot).c_str());
+
+  for(size_t t = 0; t < threads.size(); ++t)
+  {
+    fprintf(stderr, "%d threads\n", threads[t]);
+
+    reset_dictionary();
+    auto start = std::chrono::steady_clock::now();
+    predictor_type predictor(threads[t], train, k, knn::string2dt.at(distance), knn::string2it.at(index));
+    double seconds = seconds_since(start);
+
+    printf("{\"benchmark\": \"load\", \"threads\": %d, \"rows\": %lu, \"bytes\": %lu, \"seconds\": %g, "
+           "\"rows_per_second\": %g, \"megabytes_per_second\": %g}\n",
+           threads[t], predictor.training.size(), (size_t) st.st_size, seconds,
+           predictor.training.size() / seconds, st.st_size / seconds / (1 << 20));
+
+    // single threaded, on the first training set loaded
+    if(t == 0)
+    {
+      bench_normaliser<knn::ZNormaliser>(predictor.training);
+      bench_normaliser<knn::MaxMinNormaliser>(predictor.training);
+      bench_kernels(predictor.training);
+    }
+
+    std::vector<knn::Example> queries = load_queries(predictor, test);
+    bench_predict(predictor, queries, threads[t], 1);
+    bench_predict(predictor, queries, threads[t], batch);
+  }
+
+  return 0;
+}